@@ -70,12 +70,6 @@ pub fn build(b: *std.Build) void {
         exe.root_module.addImport("stb_image_write", stb_image_write.module("stb_image_write"));
     }
 
-    // stb_rect_pack
-    {
-        const stb_rect_pack = b.dependency("stb_rect_pack", .{ .target = target, .optimize = optimize });
-        exe.root_module.addImport("stb_rect_pack", stb_rect_pack.module("stb_rect_pack"));
-    }
-
     b.installArtifact(exe);
     const run_cmd = b.addRunArtifact(exe);
     run_cmd.step.dependOn(b.getInstallStep());
@@ -87,14 +81,69 @@ pub fn build(b: *std.Build) void {
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
 
-    const exe_unit_tests = b.addTest(.{
-        .root_source_file = b.path("src/main.zig"),
+    // Unit tests cover the text pipeline, which doesn't need a window or GPU.
+    const unit_tests = b.addTest(.{
+        .root_source_file = b.path("src/tests.zig"),
         .target = target,
         .optimize = optimize,
     });
+    addTextPipeline(b, unit_tests, target, optimize);
 
-    const run_exe_unit_tests = b.addRunArtifact(exe_unit_tests);
+    const run_unit_tests = b.addRunArtifact(unit_tests);
 
     const test_step = b.step("test", "Run unit tests");
-    test_step.dependOn(&run_exe_unit_tests.step);
+    test_step.dependOn(&run_unit_tests.step);
+
+    // Headless benchmark, runs the text pipeline without zglfw and zgpu.
+    {
+        const bench = b.addExecutable(.{
+            .name = "zig-text-rendering-bench",
+            .root_source_file = b.path("src/bench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        addTextPipeline(b, bench, target, optimize);
+
+        const run_bench = b.addRunArtifact(bench);
+        run_bench.setCwd(b.path("."));
+        if (b.args) |args| {
+            run_bench.addArgs(args);
+        }
+
+        const bench_step = b.step("bench", "Run text rendering benchmarks (no window or GPU needed)");
+        bench_step.dependOn(&run_bench.step);
+
+        // Reference image check of both atlas modes, a single iteration is enough to render every corpus.
+        const check_step = b.step("bench-check", "Compare rendered text with reference images (-- --record to update)");
+        for ([_][]const []const u8{ &.{}, &.{"--sdf"} }) |mode_args| {
+            const run_check = b.addRunArtifact(bench);
+            run_check.setCwd(b.path("."));
+            run_check.addArgs(&.{ "--iterations", "1", "--check" });
+            run_check.addArgs(mode_args);
+            if (b.args) |args| {
+                run_check.addArgs(args);
+            }
+            check_step.dependOn(&run_check.step);
+        }
+    }
+}
+
+/// Dependencies of the text pipeline (fonts, shaping, rasterization and CPU compositing), without zglfw and zgpu.
+fn addTextPipeline(
+    b: *std.Build,
+    compile: *std.Build.Step.Compile,
+    target: std.Build.ResolvedTarget,
+    optimize: std.builtin.OptimizeMode,
+) void {
+    const mach_freetype = b.dependency("mach_freetype", .{ .target = target, .optimize = optimize });
+    compile.root_module.addImport("mach-freetype", mach_freetype.module("mach-freetype"));
+    compile.root_module.addImport("mach-harfbuzz", mach_freetype.module("mach-harfbuzz"));
+
+    const plutosvg = b.dependency("plutosvg", .{ .target = target, .optimize = optimize });
+    compile.addIncludePath(b.path("external/plutosvg/include"));
+    compile.addIncludePath(b.path("external/plutovg/include"));
+    compile.linkLibrary(plutosvg.artifact("plutosvg"));
+
+    const stb_image_write = b.dependency("stb_image_write", .{ .target = target, .optimize = optimize });
+    compile.root_module.addImport("stb_image_write", stb_image_write.module("stb_image_write"));
 }
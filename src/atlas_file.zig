@@ -0,0 +1,288 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const Allocator = std.mem.Allocator;
+const glyph_cache = @import("glyph_cache.zig");
+const GlyphKey = glyph_cache.GlyphKey;
+const GlyphInfo = glyph_cache.GlyphInfo;
+
+// Binary layout of the on-disk glyph atlas cache. All sections are stored in native byte order, so the file is not
+// meant to be moved between machines:
+//
+// | Header | PageRecord[page_count] | NodeRecord[node_count] | GlyphRecord[glyph_count] | padding | pixels |
+//
+// Pixels start at a memory page boundary (`std.mem.page_size`, 16 KiB on Apple silicon) so that they can be used
+// directly from the memory mapping.
+
+pub const MAGIC = [4]u8{ 'Z', 'T', 'R', 'A' };
+
+/// Bump whenever layout of the file or content of the atlas pages changes.
+pub const VERSION: u32 = 4;
+
+pub const Header = extern struct {
+    magic: [4]u8,
+    version: u32,
+    key: u64, // Hash of everything that affects the rasterized glyphs.
+    page_size: u32,
+    page_counts: [2]u32, // Number of gray and color pages. Gray pages are stored first.
+    node_count: u32,
+    glyph_count: u32,
+    pixels_offset: u64,
+};
+
+/// Skyline of a page stored as a range in the node section.
+pub const PageRecord = extern struct {
+    node_start: u32,
+    node_count: u32,
+};
+
+pub const NodeRecord = extern struct {
+    x: u32,
+    y: u32,
+    width: u32,
+};
+
+/// Glyph records are sorted by key so that they can be looked up with binary search straight from the file.
+pub const GlyphRecord = extern struct {
+    font: u16,
+    size: u16,
+    glyph_id: u32,
+    x: i32,
+    y: i32,
+    width: i32,
+    height: i32,
+    bearing_x: i32,
+    bearing_y: i32,
+    format: u16,
+    sdf: u16,
+    page: u32,
+
+    pub fn init(key: GlyphKey, info: GlyphInfo) GlyphRecord {
+        return .{
+            .font = key.font,
+            .size = key.size,
+            .glyph_id = key.glyph_id,
+            .x = info.x,
+            .y = info.y,
+            .width = info.width,
+            .height = info.height,
+            .bearing_x = info.bearing_x,
+            .bearing_y = info.bearing_y,
+            .format = @intFromEnum(info.format),
+            .sdf = @intFromBool(info.sdf),
+            .page = info.page,
+        };
+    }
+
+    pub fn key(self: GlyphRecord) GlyphKey {
+        return .{ .font = self.font, .glyph_id = self.glyph_id, .size = self.size };
+    }
+
+    pub fn info(self: GlyphRecord) GlyphInfo {
+        return .{
+            .x = self.x,
+            .y = self.y,
+            .width = self.width,
+            .height = self.height,
+            .bearing_x = self.bearing_x,
+            .bearing_y = self.bearing_y,
+            .format = @enumFromInt(self.format),
+            .page = self.page,
+            .sdf = self.sdf != 0,
+        };
+    }
+
+    /// Whether the record points into one of the `page_counts` pages of the file. A damaged file could otherwise make
+    /// lookups index pages or pixels out of bounds.
+    pub fn isValid(self: GlyphRecord, page_size: u32, page_counts: [2]u32) bool {
+        if (self.format >= page_counts.len or self.sdf > 1 or self.width < 0 or self.height < 0) return false;
+        if (self.width == 0) return true; // Empty glyphs (spaces) have no place in the atlas.
+        return self.page < page_counts[self.format] and self.x >= 0 and self.y >= 0 and
+            @as(i64, self.x) + self.width <= page_size and @as(i64, self.y) + self.height <= page_size;
+    }
+
+    fn order(k: GlyphKey) u64 {
+        return (@as(u64, k.font) << 48) | (@as(u64, k.size) << 32) | k.glyph_id;
+    }
+
+    pub fn lessThan(_: void, a: GlyphRecord, b: GlyphRecord) bool {
+        return order(a.key()) < order(b.key());
+    }
+};
+
+/// Whether the nodes form a skyline of a page: non-empty segments next to each other, spanning the page width, each
+/// below the top of the page.
+pub fn isValidSkyline(nodes: []const NodeRecord, page_size: u32) bool {
+    var x: u64 = 0;
+    for (nodes) |node| {
+        if (node.x != x or node.width == 0 or node.y > page_size) return false;
+        x += node.width;
+    }
+    return x == page_size;
+}
+
+/// Binary search for the glyph in records sorted with `GlyphRecord.lessThan`.
+pub fn find(records: []const GlyphRecord, k: GlyphKey) ?GlyphRecord {
+    const target = GlyphRecord.order(k);
+    var low: usize = 0;
+    var high: usize = records.len;
+    while (low < high) {
+        const mid = low + (high - low) / 2;
+        const value = GlyphRecord.order(records[mid].key());
+        if (value == target) return records[mid];
+        if (value < target) low = mid + 1 else high = mid;
+    }
+    return null;
+}
+
+/// Content of the cache file. On POSIX systems it is a private memory mapping, so pages taken from it are copied by the
+/// kernel only when new glyphs are written into them.
+pub const Mapping = struct {
+    bytes: []align(std.mem.page_size) u8,
+
+    pub fn open(allocator: Allocator, path: []const u8) !Mapping {
+        const file = try std.fs.cwd().openFile(path, .{});
+        defer file.close();
+
+        const size: usize = @intCast((try file.stat()).size);
+        if (size < @sizeOf(Header)) {
+            return error.InvalidAtlasFile;
+        }
+
+        if (builtin.os.tag == .windows) {
+            const bytes = try allocator.alignedAlloc(u8, std.mem.page_size, size);
+            errdefer allocator.free(bytes);
+            if (try file.readAll(bytes) != size) {
+                return error.InvalidAtlasFile;
+            }
+            return .{ .bytes = bytes };
+        }
+
+        const bytes = try std.posix.mmap(
+            null,
+            size,
+            std.posix.PROT.READ | std.posix.PROT.WRITE,
+            .{ .TYPE = .PRIVATE },
+            file.handle,
+            0,
+        );
+        return .{ .bytes = bytes };
+    }
+
+    pub fn close(self: Mapping, allocator: Allocator) void {
+        if (builtin.os.tag == .windows) {
+            allocator.free(self.bytes);
+        } else {
+            std.posix.munmap(self.bytes);
+        }
+    }
+
+    pub fn header(self: Mapping) *const Header {
+        return @ptrCast(self.bytes.ptr);
+    }
+
+    /// Reinterpret `count` items of type `T` starting at `offset` without copying.
+    pub fn slice(self: Mapping, comptime T: type, offset: usize, count: usize) []T {
+        const bytes = self.bytes[offset..][0 .. count * @sizeOf(T)];
+        return @as([*]T, @ptrCast(@alignCast(bytes.ptr)))[0..count];
+    }
+};
+
+pub fn pagesOffset() usize {
+    return @sizeOf(Header);
+}
+
+pub fn nodesOffset(page_count: usize) usize {
+    return pagesOffset() + page_count * @sizeOf(PageRecord);
+}
+
+pub fn glyphsOffset(page_count: usize, node_count: usize) usize {
+    return nodesOffset(page_count) + node_count * @sizeOf(NodeRecord);
+}
+
+pub fn pixelsOffset(page_count: usize, node_count: usize, glyph_count: usize) usize {
+    const end = glyphsOffset(page_count, node_count) + glyph_count * @sizeOf(GlyphRecord);
+    return std.mem.alignForward(usize, end, std.mem.page_size);
+}
+
+test "glyph records must fit their page" {
+    const key = GlyphKey{ .font = 0, .glyph_id = 1, .size = 16 };
+    const record = GlyphRecord.init(key, .{
+        .x = 8,
+        .y = 4,
+        .width = 8,
+        .height = 12,
+        .bearing_x = 0,
+        .bearing_y = 0,
+        .format = .color,
+        .page = 1,
+        .sdf = false,
+    });
+    try std.testing.expect(record.isValid(16, .{ 0, 2 }));
+    try std.testing.expectEqual(key, record.key());
+
+    var damaged = record;
+    damaged.page = 2;
+    try std.testing.expect(!damaged.isValid(16, .{ 0, 2 }));
+    try std.testing.expect(!record.isValid(16, .{ 2, 0 })); // No color pages.
+    try std.testing.expect(!record.isValid(15, .{ 0, 2 }));
+    damaged = record;
+    damaged.x = -1;
+    try std.testing.expect(!damaged.isValid(16, .{ 0, 2 }));
+    damaged = record;
+    damaged.height = std.math.maxInt(i32);
+    try std.testing.expect(!damaged.isValid(16, .{ 0, 2 }));
+    damaged = record;
+    damaged.format = 2;
+    try std.testing.expect(!damaged.isValid(16, .{ 0, 2 }));
+    damaged = record;
+    damaged.sdf = 2;
+    try std.testing.expect(!damaged.isValid(16, .{ 0, 2 }));
+
+    // Empty glyphs don't need a page.
+    var empty = record;
+    empty.width = 0;
+    empty.height = 0;
+    empty.page = 100;
+    try std.testing.expect(empty.isValid(16, .{ 0, 0 }));
+    empty.height = -1;
+    try std.testing.expect(!empty.isValid(16, .{ 0, 0 }));
+}
+
+fn testNode(x: u32, y: u32, width: u32) NodeRecord {
+    return .{ .x = x, .y = y, .width = width };
+}
+
+test "skyline records must span the page" {
+    try std.testing.expect(isValidSkyline(&.{testNode(0, 0, 16)}, 16));
+    try std.testing.expect(isValidSkyline(&.{ testNode(0, 16, 4), testNode(4, 3, 12) }, 16));
+    try std.testing.expect(!isValidSkyline(&.{}, 16));
+    try std.testing.expect(!isValidSkyline(&.{testNode(0, 0, 8)}, 16)); // Too short.
+    try std.testing.expect(!isValidSkyline(&.{testNode(0, 17, 16)}, 16)); // Above the page.
+    try std.testing.expect(!isValidSkyline(&.{ testNode(0, 0, 8), testNode(9, 0, 7) }, 16)); // Gap.
+    try std.testing.expect(!isValidSkyline(&.{ testNode(0, 0, 0), testNode(0, 0, 16) }, 16)); // Empty segment.
+    try std.testing.expect(!isValidSkyline(&.{ testNode(0, 0, 16), testNode(16, 0, 1) }, 16)); // Past the edge.
+}
+
+test "glyph records are found by key" {
+    var records: [5]GlyphRecord = undefined;
+    const keys = [_]GlyphKey{
+        .{ .font = 1, .glyph_id = 3, .size = 16 },
+        .{ .font = 0, .glyph_id = 9, .size = 16 },
+        .{ .font = 0, .glyph_id = 2, .size = 32 },
+        .{ .font = 0, .glyph_id = 2, .size = 16 },
+        .{ .font = 2, .glyph_id = 0, .size = 8 },
+    };
+    for (&records, keys, 0..) |*record, k, i| {
+        record.* = std.mem.zeroes(GlyphRecord);
+        record.font = k.font;
+        record.glyph_id = k.glyph_id;
+        record.size = k.size;
+        record.x = @intCast(i);
+    }
+    std.mem.sort(GlyphRecord, &records, {}, GlyphRecord.lessThan);
+    for (keys, 0..) |k, i| {
+        try std.testing.expectEqual(@as(i32, @intCast(i)), find(&records, k).?.x);
+    }
+    try std.testing.expect(find(&records, .{ .font = 0, .glyph_id = 3, .size = 16 }) == null);
+    try std.testing.expect(find(&.{}, keys[0]) == null);
+}
@@ -0,0 +1,502 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const Allocator = std.mem.Allocator;
+const font = @import("font.zig");
+const quads = @import("quads.zig");
+const corpus = @import("corpus.zig");
+const Canvas = @import("canvas.zig").Canvas;
+const Layout = @import("layout.zig").Layout;
+const Fitting = @import("layout.zig").Fitting;
+const FontLibrary = font.FontLibrary;
+
+// Headless benchmark of the text pipeline: font loading, rasterization into the atlas, itemization, shaping, quad
+// generation and paragraph layout of a large document. Runs without a window or GPU, quads are composited on the CPU
+// for reference image checks.
+//
+// zig build bench -- [options]
+//
+// Results are printed to stdout as a single JSON object.
+
+const usage =
+    \\Usage: zig build bench -- [options]
+    \\
+    \\  --iterations N    Number of timed repetitions of each corpus (default 100).
+    \\  --threads N       Rasterizer threads (default: number of CPU cores).
+    \\  --dpr N           Device pixel ratio (default 1).
+    \\  --sdf             Render outline fonts as distance fields.
+    \\  --png DIR         Write rendered corpora as PNG images to DIR.
+    \\  --reference DIR   Directory with reference images (default bench/reference).
+    \\  --record          Save rendered corpora as new reference images instead of comparing.
+    \\  --check           Fail if a reference image is missing, not only if rendering differs.
+    \\
+;
+
+const Args = struct {
+    iterations: u32 = 100,
+    thread_count: ?u32 = null,
+    dpr: u32 = 1,
+    sdf: bool = false,
+    png_dir: ?[]const u8 = null,
+    reference_dir: []const u8 = "bench/reference",
+    record: bool = false,
+    check: bool = false,
+};
+
+/// Allowed difference per channel and number of differing pixels before a reference check fails. Leaves room for
+/// rounding differences between platforms.
+const REFERENCE_TOLERANCE = 2;
+const REFERENCE_MAX_DIFF_PIXELS = 16;
+
+/// Sizes (in logical px) each corpus is shaped at in addition to `font.font_size`.
+const OTHER_SIZES = [_]u16{ 12, 24, 36, 48 };
+
+/// Size of the text each corpus is repeated into to measure itemization.
+const ITEMIZE_BYTES = 256 * 1024;
+
+/// Paragraphs in the layout document, each made of all lines of one corpus.
+const LAYOUT_PARAGRAPHS = 20_000;
+/// Widths (in logical px) the layout document is fitted to, one after another.
+const LAYOUT_WIDTHS = [_]i32{ 400, 600, 800, 1000, 1200 };
+const LAYOUT_EDITS = 100;
+const LAYOUT_SCREEN_HEIGHT = 1000; // (in logical px).
+
+const CorpusResult = struct {
+    name: []const u8,
+    lines: usize,
+    glyphs: usize, // Shaped glyphs in one pass over the corpus.
+    runs: usize, // Distinct single-script runs in the corpus, each shaped once per pass.
+    rasterized_glyphs: usize, // Glyphs added to the atlas by the cold pass.
+    cold_ms: f64, // First pass: itemization, shaping and rasterization.
+    cold_glyphs_per_s: f64,
+    shaped_runs_per_s: f64, // Shape cache cleared before each pass, atlas warm.
+    warm_glyphs_per_s: f64, // Everything cached, as for static text in the app.
+    quads_per_s: f64,
+    itemize_bytes_per_s: f64, // Splitting into font and script ranges only.
+    other_sizes_ms: f64, // Cold pass at each of `OTHER_SIZES`.
+    other_sizes_rasterized_glyphs: usize,
+    reference: []const u8, // "pass", "fail", "missing" or "recorded".
+    reference_diff_pixels: usize,
+};
+
+const LayoutResult = struct {
+    paragraphs: usize,
+    lines: usize, // At the last of `LAYOUT_WIDTHS`.
+    build_ms: f64, // Splitting, shaping and greedy fitting of the whole document.
+    resize_greedy_ms: f64, // Average per width change, lines are fitted again without shaping.
+    resize_optimal_ms: f64,
+    edit_ms: f64, // Average per edited paragraph, including the update.
+    visible_glyphs: usize, // Glyphs of one screen of lines in the middle of the document.
+    visible_glyphs_ms: f64,
+};
+
+const Report = struct {
+    threads: u32,
+    dpr: u32,
+    sdf: bool,
+    iterations: u32,
+    startup_ms: f64,
+    corpora: []const CorpusResult,
+    layout: LayoutResult,
+    shape_cache_hits: u64,
+    shape_cache_misses: u64,
+    atlas_glyphs: usize,
+    atlas_pages: [2]usize, // Gray and color.
+    peak_heap_bytes: usize, // Zig allocations only, FreeType and HarfBuzz use their own.
+    max_rss_bytes: usize, // Zero where not available.
+};
+
+pub fn main() !void {
+    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+    defer _ = gpa.deinit();
+
+    var counting = CountingAllocator{ .parent = gpa.allocator() };
+    const allocator = counting.allocator();
+
+    var arg_iterator = try std.process.argsWithAllocator(allocator);
+    defer arg_iterator.deinit();
+    const args = parseArgs(&arg_iterator) catch |err| {
+        std.debug.print("{s}\n{s}", .{ @errorName(err), usage });
+        std.process.exit(2);
+    };
+
+    var timer = try std.time.Timer.start();
+    const thread_count = args.thread_count orelse @as(u32, @intCast(std.Thread.getCpuCount() catch 1));
+    var library = try FontLibrary.init(allocator, args.dpr, .{
+        .thread_count = thread_count,
+        .cache_path = null,
+        .sdf = args.sdf,
+    });
+    defer library.deinit();
+    const startup_ns = timer.read();
+
+    var results = std.ArrayList(CorpusResult).init(allocator);
+    defer results.deinit();
+
+    // With --check a corpus without a reference image fails too, so a missing file can't pass the check unnoticed.
+    var failed = false;
+    for (corpus.all) |c| {
+        const result = try runCorpus(allocator, &library, c, args);
+        if (std.mem.eql(u8, result.reference, "fail")) failed = true;
+        if (args.check and std.mem.eql(u8, result.reference, "missing")) failed = true;
+        try results.append(result);
+    }
+    const layout_result = try runLayout(allocator, &library, args);
+
+    const stats = library.shape_cache.stats();
+    const report = Report{
+        .threads = thread_count,
+        .dpr = args.dpr,
+        .sdf = args.sdf,
+        .iterations = args.iterations,
+        .startup_ms = millis(startup_ns),
+        .corpora = results.items,
+        .layout = layout_result,
+        .shape_cache_hits = stats.hits,
+        .shape_cache_misses = stats.misses,
+        .atlas_glyphs = library.glyph_cache.glyphs.count(),
+        .atlas_pages = .{
+            library.glyph_cache.atlas(.gray).pages.items.len,
+            library.glyph_cache.atlas(.color).pages.items.len,
+        },
+        .peak_heap_bytes = counting.peak,
+        .max_rss_bytes = maxRss(),
+    };
+
+    const stdout = std.io.getStdOut().writer();
+    try std.json.stringify(report, .{ .whitespace = .indent_2 }, stdout);
+    try stdout.writeByte('\n');
+
+    if (failed) {
+        std.debug.print("Rendering differs from reference images or they are missing (see --record)\n", .{});
+        std.process.exit(1);
+    }
+}
+
+fn parseArgs(iterator: *std.process.ArgIterator) !Args {
+    var args = Args{};
+    _ = iterator.skip();
+    while (iterator.next()) |arg| {
+        if (std.mem.eql(u8, arg, "--iterations")) {
+            args.iterations = try std.fmt.parseInt(u32, iterator.next() orelse return error.MissingValue, 10);
+        } else if (std.mem.eql(u8, arg, "--threads")) {
+            args.thread_count = try std.fmt.parseInt(u32, iterator.next() orelse return error.MissingValue, 10);
+        } else if (std.mem.eql(u8, arg, "--dpr")) {
+            args.dpr = try std.fmt.parseInt(u32, iterator.next() orelse return error.MissingValue, 10);
+        } else if (std.mem.eql(u8, arg, "--sdf")) {
+            args.sdf = true;
+        } else if (std.mem.eql(u8, arg, "--png")) {
+            args.png_dir = iterator.next() orelse return error.MissingValue;
+        } else if (std.mem.eql(u8, arg, "--reference")) {
+            args.reference_dir = iterator.next() orelse return error.MissingValue;
+        } else if (std.mem.eql(u8, arg, "--record")) {
+            args.record = true;
+        } else if (std.mem.eql(u8, arg, "--check")) {
+            args.check = true;
+        } else if (std.mem.eql(u8, arg, "--help")) {
+            std.debug.print("{s}", .{usage});
+            std.process.exit(0);
+        } else {
+            return error.UnknownArgument;
+        }
+    }
+    if (args.iterations == 0 or args.dpr == 0) return error.InvalidValue;
+    return args;
+}
+
+fn runCorpus(allocator: Allocator, library: *FontLibrary, c: corpus.Corpus, args: Args) !CorpusResult {
+    var timer = try std.time.Timer.start();
+    const glyphs_before = library.glyph_cache.glyphs.count();
+    const misses_before = library.shape_cache.stats().misses;
+
+    // Cold pass, nothing from the corpus is shaped or rasterized yet. The shaped lines are kept for quad generation.
+    const shaped = try allocator.alloc([]font.GlyphShape, c.lines.len);
+    defer allocator.free(shaped);
+    var glyph_count: usize = 0;
+    var shaped_count: usize = 0;
+    defer {
+        for (shaped[0..shaped_count]) |glyphs| allocator.free(glyphs);
+    }
+
+    library.glyph_cache.nextFrame();
+    timer.reset();
+    for (c.lines, shaped) |line, *glyphs| {
+        glyphs.* = try font.shape(allocator, library, line, font.font_size);
+        shaped_count += 1;
+        glyph_count += glyphs.len;
+    }
+    const cold_ns = timer.read();
+    const run_count = library.shape_cache.stats().misses - misses_before;
+    const rasterized = library.glyph_cache.glyphs.count() - glyphs_before;
+
+    // Shaping, with glyphs already in the atlas.
+    timer.reset();
+    for (0..args.iterations) |_| {
+        library.shape_cache.clear();
+        library.glyph_cache.nextFrame();
+        try shapeAll(allocator, library, c.lines, font.font_size);
+    }
+    const shaping_ns = timer.read();
+
+    // Shape cache hits, the common case for static text.
+    timer.reset();
+    for (0..args.iterations) |_| {
+        library.glyph_cache.nextFrame();
+        try shapeAll(allocator, library, c.lines, font.font_size);
+    }
+    const warm_ns = timer.read();
+
+    // Quad generation.
+    var instances = std.ArrayList(quads.Instance).init(allocator);
+    defer instances.deinit();
+    const line_height: f32 = @floatFromInt(font.font_size * 2 * args.dpr);
+    const margin: f32 = line_height;
+
+    timer.reset();
+    for (0..args.iterations) |_| {
+        instances.clearRetainingCapacity();
+        for (shaped, 0..) |glyphs, i| {
+            const y = margin + line_height * @as(f32, @floatFromInt(i));
+            _ = try quads.appendQuads(&instances, glyphs, .{ margin, y }, .{ 0, 0, 0, 1 });
+        }
+    }
+    const quads_ns = timer.read();
+
+    // Composite on the CPU and compare with the reference image.
+    const width: u32 = 1200 * args.dpr;
+    const height: u32 = @intFromFloat(margin * 2 + line_height * @as(f32, @floatFromInt(c.lines.len)));
+    var canvas = try Canvas.init(allocator, width, height);
+    defer canvas.deinit();
+    @memset(canvas.pixels, 255);
+    canvas.drawQuads(&library.glyph_cache, instances.items);
+
+    if (args.png_dir) |dir| {
+        try std.fs.cwd().makePath(dir);
+        const mode = if (args.sdf) "-sdf" else "";
+        const path = try std.fmt.allocPrintZ(allocator, "{s}/{s}{s}.png", .{ dir, c.name, mode });
+        defer allocator.free(path);
+        try canvas.writePng(path);
+    }
+    const check = try checkReference(allocator, &canvas, c.name, args);
+
+    // Itemization of a long text, large enough that allocating the ranges doesn't dominate.
+    var long_text = std.ArrayList(u8).init(allocator);
+    defer long_text.deinit();
+    while (long_text.items.len < ITEMIZE_BYTES) {
+        for (c.lines) |line| {
+            try long_text.appendSlice(line);
+            try long_text.append(' ');
+        }
+    }
+    timer.reset();
+    for (0..args.iterations) |_| {
+        const ranges = try font.getRanges(allocator, library, long_text.items);
+        allocator.free(ranges);
+    }
+    const itemize_ns = timer.read();
+
+    // Other text sizes, after the image is done so that new glyphs can't evict the ones it uses. With distance fields
+    // they reuse glyphs rasterized by the cold pass (except emoji).
+    const glyphs_before_sizes = library.glyph_cache.glyphs.count();
+    timer.reset();
+    for (OTHER_SIZES) |size| {
+        library.glyph_cache.nextFrame();
+        try shapeAll(allocator, library, c.lines, size);
+    }
+    const sizes_ns = timer.read();
+    const sizes_rasterized = library.glyph_cache.glyphs.count() - glyphs_before_sizes;
+
+    const iterations: f64 = @floatFromInt(args.iterations);
+    const glyphs: f64 = @floatFromInt(glyph_count);
+    const runs: f64 = @floatFromInt(run_count);
+    return CorpusResult{
+        .name = c.name,
+        .lines = c.lines.len,
+        .glyphs = glyph_count,
+        .runs = run_count,
+        .rasterized_glyphs = rasterized,
+        .cold_ms = millis(cold_ns),
+        .cold_glyphs_per_s = perSecond(glyphs, cold_ns),
+        .shaped_runs_per_s = perSecond(runs * iterations, shaping_ns),
+        .warm_glyphs_per_s = perSecond(glyphs * iterations, warm_ns),
+        .quads_per_s = perSecond(glyphs * iterations, quads_ns),
+        .itemize_bytes_per_s = perSecond(@as(f64, @floatFromInt(long_text.items.len)) * iterations, itemize_ns),
+        .other_sizes_ms = millis(sizes_ns),
+        .other_sizes_rasterized_glyphs = sizes_rasterized,
+        .reference = check.status,
+        .reference_diff_pixels = check.diff_pixels,
+    };
+}
+
+/// Lay out a long document of all corpora, then resize it, edit paragraphs and collect the glyphs of one screen.
+fn runLayout(allocator: Allocator, library: *FontLibrary, args: Args) !LayoutResult {
+    var paragraphs = std.ArrayList([]const u8).init(allocator);
+    defer {
+        for (paragraphs.items) |paragraph| allocator.free(paragraph);
+        paragraphs.deinit();
+    }
+    for (corpus.all) |c| {
+        try paragraphs.append(try std.mem.join(allocator, " ", c.lines));
+    }
+
+    var document = std.ArrayList(u8).init(allocator);
+    defer document.deinit();
+    for (0..LAYOUT_PARAGRAPHS) |i| {
+        if (i > 0) try document.append('\n');
+        try document.appendSlice(paragraphs.items[i % paragraphs.items.len]);
+    }
+
+    const dpr: i32 = @intCast(args.dpr);
+    var layout = Layout.init(allocator, library, .{ .max_width = LAYOUT_WIDTHS[0] * dpr });
+    defer layout.deinit();
+
+    var timer = try std.time.Timer.start();
+    library.glyph_cache.nextFrame();
+    try layout.setText(document.items);
+    try layout.update();
+    const build_ns = timer.read();
+
+    // Fitting only, words stay shaped.
+    var resize_ns = [2]u64{ 0, 0 };
+    for ([_]Fitting{ .greedy, .optimal }, &resize_ns) |fitting, *total| {
+        layout.setFitting(fitting);
+        try layout.update();
+        timer.reset();
+        for (LAYOUT_WIDTHS[1..] ++ LAYOUT_WIDTHS[0..1]) |width| {
+            layout.setMaxWidth(width * dpr);
+            try layout.update();
+        }
+        total.* = timer.read();
+    }
+    layout.setFitting(.greedy);
+    layout.setMaxWidth(LAYOUT_WIDTHS[LAYOUT_WIDTHS.len - 1] * dpr);
+    try layout.update();
+
+    // Edits spread over the document, each followed by an update as when typing.
+    timer.reset();
+    for (0..LAYOUT_EDITS) |i| {
+        const index = (i * 7919) % LAYOUT_PARAGRAPHS;
+        const text = paragraphs.items[(index + 1) % paragraphs.items.len];
+        library.glyph_cache.nextFrame();
+        try layout.replaceParagraphs(index, 1, text);
+        try layout.update();
+    }
+    const edit_ns = timer.read();
+
+    var shapes = std.ArrayList(font.GlyphShape).init(allocator);
+    defer shapes.deinit();
+    const top = @divFloor(layout.height(), 2);
+    timer.reset();
+    for (0..args.iterations) |_| {
+        shapes.clearRetainingCapacity();
+        library.glyph_cache.nextFrame();
+        _ = try layout.appendGlyphs(&shapes, top, top + LAYOUT_SCREEN_HEIGHT * dpr);
+    }
+    const visible_ns = timer.read();
+
+    const iterations: f64 = @floatFromInt(args.iterations);
+    const resize_count: f64 = @floatFromInt(LAYOUT_WIDTHS.len);
+    return LayoutResult{
+        .paragraphs = layout.paragraphCount(),
+        .lines = layout.lineCount(),
+        .build_ms = millis(build_ns),
+        .resize_greedy_ms = millis(resize_ns[0]) / resize_count,
+        .resize_optimal_ms = millis(resize_ns[1]) / resize_count,
+        .edit_ms = millis(edit_ns) / LAYOUT_EDITS,
+        .visible_glyphs = shapes.items.len,
+        .visible_glyphs_ms = millis(visible_ns) / iterations,
+    };
+}
+
+fn shapeAll(allocator: Allocator, library: *FontLibrary, lines: []const []const u8, size: u16) !void {
+    for (lines) |line| {
+        const glyphs = try font.shape(allocator, library, line, size);
+        allocator.free(glyphs);
+    }
+}
+
+fn checkReference(
+    allocator: Allocator,
+    canvas: *const Canvas,
+    name: []const u8,
+    args: Args,
+) !struct { status: []const u8, diff_pixels: usize } {
+    const mode = if (args.sdf) "-sdf" else "";
+    const path = try std.fmt.allocPrint(allocator, "{s}/{s}-{d}x{s}.pam", .{ args.reference_dir, name, args.dpr, mode });
+    defer allocator.free(path);
+
+    if (args.record) {
+        try std.fs.cwd().makePath(args.reference_dir);
+        try canvas.writePam(path);
+        return .{ .status = "recorded", .diff_pixels = 0 };
+    }
+
+    var reference = Canvas.readPam(allocator, path) catch |err| switch (err) {
+        error.FileNotFound => return .{ .status = "missing", .diff_pixels = 0 },
+        else => return err,
+    };
+    defer reference.deinit();
+
+    const diff_pixels = canvas.diff(&reference, REFERENCE_TOLERANCE);
+    return .{ .status = if (diff_pixels > REFERENCE_MAX_DIFF_PIXELS) "fail" else "pass", .diff_pixels = diff_pixels };
+}
+
+fn millis(ns: u64) f64 {
+    return @as(f64, @floatFromInt(ns)) / std.time.ns_per_ms;
+}
+
+fn perSecond(count: f64, ns: u64) f64 {
+    if (ns == 0) return 0;
+    return count * std.time.ns_per_s / @as(f64, @floatFromInt(ns));
+}
+
+fn maxRss() usize {
+    switch (builtin.os.tag) {
+        .linux => return @as(usize, @intCast(std.posix.getrusage(std.posix.rusage.SELF).maxrss)) * 1024,
+        .macos => return @intCast(std.posix.getrusage(std.posix.rusage.SELF).maxrss),
+        else => return 0,
+    }
+}
+
+/// Forwards to `parent` and keeps track of the highest number of bytes allocated at once. Safe to use from multiple
+/// threads as long as `parent` is.
+const CountingAllocator = struct {
+    parent: Allocator,
+    current: usize = 0,
+    peak: usize = 0,
+
+    fn allocator(self: *CountingAllocator) Allocator {
+        return .{
+            .ptr = self,
+            .vtable = &.{ .alloc = alloc, .resize = resize, .free = free },
+        };
+    }
+
+    fn alloc(ctx: *anyopaque, len: usize, ptr_align: u8, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        const result = self.parent.rawAlloc(len, ptr_align, ret_addr) orelse return null;
+        self.add(len);
+        return result;
+    }
+
+    fn resize(ctx: *anyopaque, buf: []u8, buf_align: u8, new_len: usize, ret_addr: usize) bool {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        if (!self.parent.rawResize(buf, buf_align, new_len, ret_addr)) return false;
+        if (new_len > buf.len) {
+            self.add(new_len - buf.len);
+        } else {
+            _ = @atomicRmw(usize, &self.current, .Sub, buf.len - new_len, .monotonic);
+        }
+        return true;
+    }
+
+    fn free(ctx: *anyopaque, buf: []u8, buf_align: u8, ret_addr: usize) void {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        self.parent.rawFree(buf, buf_align, ret_addr);
+        _ = @atomicRmw(usize, &self.current, .Sub, buf.len, .monotonic);
+    }
+
+    fn add(self: *CountingAllocator, len: usize) void {
+        const current = @atomicRmw(usize, &self.current, .Add, len, .monotonic) + len;
+        _ = @atomicRmw(usize, &self.peak, .Max, current, .monotonic);
+    }
+};
@@ -0,0 +1,321 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+// Bidirectional text following the Unicode Bidirectional Algorithm (UAX #9, https://www.unicode.org/reports/tr9/),
+// without explicit embeddings, overrides and isolates (their formatting characters are ignored) and without bracket
+// pairs (N0). That covers mixed left-to-right and right-to-left text as typed, which is what the layout needs.
+
+/// Bidi character type.
+pub const Class = enum {
+    l, // Left-to-right.
+    r, // Right-to-left.
+    al, // Arabic letter.
+    en, // European number.
+    es, // European separator.
+    et, // European terminator.
+    an, // Arabic number.
+    cs, // Common separator.
+    nsm, // Non-spacing mark.
+    bn, // Boundary neutral.
+    b, // Paragraph separator.
+    s, // Segment separator.
+    ws, // Whitespace.
+    on, // Other neutral.
+
+    fn isNeutral(self: Class) bool {
+        return self == .b or self == .s or self == .ws or self == .on;
+    }
+};
+
+/// Whether text at the level is placed right to left.
+pub fn isRtl(level: u8) bool {
+    return level % 2 == 1;
+}
+
+/// Resolve embedding levels of a paragraph. Each byte of `levels` (same length as `text`) gets the level of the
+/// character it belongs to. Returns the paragraph level: 1 if the first strong character is right-to-left, 0 otherwise.
+pub fn resolveLevels(allocator: Allocator, text: []const u8, levels: []u8) !u8 {
+    std.debug.assert(levels.len == text.len);
+
+    // Classes before and after resolving weak and neutral types, one per character.
+    var count: usize = 0;
+    var utf8 = (try std.unicode.Utf8View.init(text)).iterator();
+    while (utf8.nextCodepoint()) |_| count += 1;
+
+    const buffer = try allocator.alloc(Class, count * 2);
+    defer allocator.free(buffer);
+    const original = buffer[0..count];
+    const classes = buffer[count..];
+
+    utf8 = (try std.unicode.Utf8View.init(text)).iterator();
+    for (original) |*class| {
+        class.* = classify(utf8.nextCodepoint().?);
+    }
+    @memcpy(classes, original);
+
+    // P2 and P3.
+    var paragraph_level: u8 = 0;
+    for (original) |class| {
+        switch (class) {
+            .l => break,
+            .r, .al => {
+                paragraph_level = 1;
+                break;
+            },
+            else => {},
+        }
+    }
+    const sos: Class = if (isRtl(paragraph_level)) .r else .l;
+
+    // W1: marks (and ignored boundary neutrals) take the type of the previous character.
+    var previous = sos;
+    for (classes) |*class| {
+        if (class.* == .nsm or class.* == .bn) class.* = previous;
+        previous = class.*;
+    }
+
+    // W2 and W3: European numbers after Arabic letters are Arabic numbers, then Arabic letters are right-to-left.
+    var strong = sos;
+    for (classes) |*class| {
+        switch (class.*) {
+            .l, .r, .al => strong = class.*,
+            .en => if (strong == .al) {
+                class.* = .an;
+            },
+            else => {},
+        }
+    }
+    for (classes) |*class| {
+        if (class.* == .al) class.* = .r;
+    }
+
+    // W4: a single separator between two numbers of the same type joins them.
+    var i: usize = 1;
+    while (i + 1 < classes.len) : (i += 1) {
+        const before = classes[i - 1];
+        const after = classes[i + 1];
+        switch (classes[i]) {
+            .es => if (before == .en and after == .en) {
+                classes[i] = .en;
+            },
+            .cs => if (before == after and (before == .en or before == .an)) {
+                classes[i] = before;
+            },
+            else => {},
+        }
+    }
+
+    // W5: terminators next to European numbers ("$5", "5%") are numbers too.
+    i = 0;
+    while (i < classes.len) {
+        if (classes[i] != .et) {
+            i += 1;
+            continue;
+        }
+        var end = i;
+        while (end < classes.len and classes[end] == .et) end += 1;
+        if ((i > 0 and classes[i - 1] == .en) or (end < classes.len and classes[end] == .en)) {
+            @memset(classes[i..end], .en);
+        }
+        i = end;
+    }
+
+    // W6: remaining separators and terminators are neutral.
+    for (classes) |*class| {
+        switch (class.*) {
+            .es, .et, .cs => class.* = .on,
+            else => {},
+        }
+    }
+
+    // W7: European numbers in left-to-right context are left-to-right.
+    strong = sos;
+    for (classes) |*class| {
+        switch (class.*) {
+            .l, .r => strong = class.*,
+            .en => if (strong == .l) {
+                class.* = .l;
+            },
+            else => {},
+        }
+    }
+
+    // N1 and N2: neutrals between characters of the same direction get that direction (numbers count as
+    // right-to-left), other neutrals get the paragraph direction.
+    i = 0;
+    while (i < classes.len) {
+        if (!classes[i].isNeutral()) {
+            i += 1;
+            continue;
+        }
+        var end = i;
+        while (end < classes.len and classes[end].isNeutral()) end += 1;
+        const before = if (i > 0) strongDirection(classes[i - 1]) else sos;
+        const after = if (end < classes.len) strongDirection(classes[end]) else sos;
+        @memset(classes[i..end], if (before == after) before else sos);
+        i = end;
+    }
+
+    // I1, I2 and L1 (separators and trailing whitespace get the paragraph level), then spread to bytes.
+    var trailing = true;
+    var index = count;
+    var byte = text.len;
+    while (index > 0) {
+        index -= 1;
+        const reset = switch (original[index]) {
+            .b, .s => true,
+            .ws, .bn => trailing,
+            else => false,
+        };
+        trailing = reset;
+
+        const level = if (reset) paragraph_level else implicitLevel(paragraph_level, classes[index]);
+        var start = byte - 1;
+        while (start > 0 and (text[start] & 0xC0) == 0x80) start -= 1; // Continuation bytes.
+        @memset(levels[start..byte], level);
+        byte = start;
+    }
+    return paragraph_level;
+}
+
+fn strongDirection(class: Class) Class {
+    return if (class == .l) .l else .r;
+}
+
+fn implicitLevel(paragraph_level: u8, class: Class) u8 {
+    if (isRtl(paragraph_level)) {
+        return if (class == .r) paragraph_level else paragraph_level + 1;
+    }
+    return switch (class) {
+        .r => paragraph_level + 1,
+        .an, .en => paragraph_level + 2,
+        else => paragraph_level,
+    };
+}
+
+/// Bidi class of a codepoint. Characters of scripts without fonts in the app fall back to left-to-right.
+pub fn classify(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0000...0x00FF => latin1(@intCast(codepoint)),
+        0x0300...0x036F, 0x0483...0x0489, 0x20D0...0x20FF, 0x302A...0x302D, 0x3099, 0x309A, 0xFE00...0xFE0F,
+        0xFE20...0xFE2F, 0xE0100...0xE01EF,
+        => .nsm,
+        0x0590...0x05FF => hebrew(codepoint),
+        0x0600...0x06FF => arabic(codepoint),
+        0x0700...0x07BF, 0x0860...0x08FF, 0xFB50...0xFDFF, 0xFE70...0xFEFE, 0x1EE00...0x1EEFF => .al,
+        0x07C0...0x085F, 0xFB1D...0xFB4F, 0x10800...0x10FFF, 0x1E800...0x1EDFF => .r,
+        0x0900...0x097F => devanagari(codepoint),
+        0x1680, 0x3000 => .ws,
+        0x2000...0x206F => punctuation(codepoint),
+        0x20A0...0x20CF => .et,
+        0x2190...0x2211, 0x2213...0x2BFF, 0x3001...0x3004, 0x3008...0x3020, 0x3030, 0x303D...0x303F,
+        0x1F000...0x1FAFF,
+        => .on,
+        0x2212 => .es,
+        0xFEFF, 0xE0001...0xE007F => .bn,
+        0xFF00...0xFF65 => fullwidth(codepoint),
+        else => .l,
+    };
+}
+
+fn latin1(c: u8) Class {
+    return switch (c) {
+        0x00...0x08, 0x0E...0x1B, 0x7F...0x84, 0x86...0x9F, 0xAD => .bn,
+        0x09, 0x0B, 0x1F => .s,
+        0x0A, 0x0D, 0x1C...0x1E, 0x85 => .b,
+        0x0C, ' ' => .ws,
+        '0'...'9', 0xB2, 0xB3, 0xB9 => .en,
+        '+', '-' => .es,
+        '#', '$', '%', 0xA2...0xA5, 0xB0, 0xB1 => .et,
+        ',', '.', '/', ':', 0xA0 => .cs,
+        '!', '"', '&'...'*', ';'...'@', '['...'`', '{'...'~', 0xA1, 0xA6...0xA9, 0xAB, 0xAC, 0xAE, 0xAF, 0xB4,
+        0xB6...0xB8, 0xBB...0xBF, 0xD7, 0xF7,
+        => .on,
+        else => .l,
+    };
+}
+
+fn hebrew(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0591...0x05BD, 0x05BF, 0x05C1, 0x05C2, 0x05C4, 0x05C5, 0x05C7 => .nsm,
+        else => .r,
+    };
+}
+
+fn arabic(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0600...0x0605, 0x0660...0x0669, 0x066B, 0x066C, 0x06DD => .an,
+        0x0609, 0x060A, 0x066A => .et,
+        0x060C => .cs,
+        0x060E, 0x060F, 0x06DE, 0x06E9 => .on,
+        0x0610...0x061A, 0x064B...0x065F, 0x0670, 0x06D6...0x06DC, 0x06DF...0x06E4, 0x06E7, 0x06E8,
+        0x06EA...0x06ED,
+        => .nsm,
+        0x06F0...0x06F9 => .en,
+        else => .al,
+    };
+}
+
+fn devanagari(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0900...0x0902, 0x093A, 0x093C, 0x0941...0x0948, 0x094D, 0x0951...0x0957, 0x0962, 0x0963 => .nsm,
+        else => .l,
+    };
+}
+
+fn punctuation(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x2000...0x200A, 0x2028, 0x205F => .ws,
+        // Explicit embeddings, overrides and isolates are not supported and ignored like other format characters.
+        0x200B...0x200D, 0x202A...0x202E, 0x2060...0x2064, 0x2066...0x206F => .bn,
+        0x200E => .l,
+        0x200F => .r,
+        0x2029 => .b,
+        0x202F, 0x2044 => .cs,
+        0x2030...0x2034 => .et,
+        else => .on,
+    };
+}
+
+fn fullwidth(codepoint: u21) Class {
+    return switch (codepoint) {
+        0xFF03...0xFF05 => .et,
+        0xFF0B, 0xFF0D => .es,
+        0xFF0C, 0xFF0E, 0xFF0F, 0xFF1A => .cs,
+        0xFF10...0xFF19 => .en,
+        0xFF21...0xFF3A, 0xFF41...0xFF5A => .l,
+        else => .on,
+    };
+}
+
+/// Check the paragraph level and the level of each character (not byte) of `text`.
+fn expectLevels(text: []const u8, paragraph_level: u8, expected: []const u8) !void {
+    const allocator = std.testing.allocator;
+    const levels = try allocator.alloc(u8, text.len);
+    defer allocator.free(levels);
+    try std.testing.expectEqual(paragraph_level, try resolveLevels(allocator, text, levels));
+
+    var actual = std.ArrayList(u8).init(allocator);
+    defer actual.deinit();
+    var utf8 = (try std.unicode.Utf8View.init(text)).iterator();
+    var index: usize = 0;
+    while (utf8.nextCodepointSlice()) |bytes| {
+        // All bytes of a character share its level.
+        for (levels[index..][0..bytes.len]) |level| try std.testing.expectEqual(levels[index], level);
+        try actual.append(levels[index]);
+        index += bytes.len;
+    }
+    try std.testing.expectEqualSlices(u8, expected, actual.items);
+}
+
+test "levels of left-to-right paragraph with right-to-left text and numbers" {
+    try expectLevels("ab אב 12", 0, &.{ 0, 0, 0, 1, 1, 1, 2, 2 });
+    try expectLevels("hello", 0, &.{ 0, 0, 0, 0, 0 });
+}
+
+test "levels of right-to-left paragraph with numbers and left-to-right text" {
+    // European digits after Arabic letters are Arabic numbers.
+    try expectLevels("اب 12 cd", 1, &.{ 1, 1, 1, 2, 2, 1, 2, 2 });
+    // A separator between digits joins them into one number.
+    try expectLevels("א 3.14", 1, &.{ 1, 1, 2, 2, 2, 2 });
+}
@@ -0,0 +1,208 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const stb_image_write = @import("stb_image_write");
+const glyph_cache = @import("glyph_cache.zig");
+const GlyphCache = glyph_cache.GlyphCache;
+const Instance = @import("quads.zig").Instance;
+
+/// CPU render target for glyph quads. Follows what the `Printer` shaders do, so text can be rendered and checked
+/// without a window or a GPU.
+pub const Canvas = struct {
+    allocator: Allocator,
+    width: u32,
+    height: u32,
+    pixels: []u8, // RGBA, 8 bits per channel, rows top to bottom.
+
+    pub fn init(allocator: Allocator, width: u32, height: u32) !Canvas {
+        const pixels = try allocator.alloc(u8, width * height * 4);
+        @memset(pixels, 0);
+        return .{ .allocator = allocator, .width = width, .height = height, .pixels = pixels };
+    }
+
+    pub fn deinit(self: *Canvas) void {
+        self.allocator.free(self.pixels);
+    }
+
+    /// Blend quads onto the canvas using the same blend state as the printer pipeline. Unscaled quads are pixel
+    /// aligned, so their texels are copied 1:1. Distance fields are sampled bilinearly.
+    pub fn drawQuads(self: *Canvas, cache: *const GlyphCache, instances: []const Instance) void {
+        for (instances) |instance| {
+            const format = instance.mode.format();
+            const source = Source{
+                .pixels = cache.pagePixels(format, instance.page),
+                .page_size = cache.page_size,
+                .bytes_per_pixel = format.bytesPerPixel(),
+                .rect = instance.rect,
+            };
+
+            const x0: i64 = @intFromFloat(@round(instance.position[0]));
+            const y0: i64 = @intFromFloat(@round(instance.position[1]));
+            const width: u32 = @intFromFloat(@round(@as(f32, @floatFromInt(instance.rect[2])) * instance.scale));
+            const height: u32 = @intFromFloat(@round(@as(f32, @floatFromInt(instance.rect[3])) * instance.scale));
+
+            for (0..height) |row| {
+                const y = y0 + @as(i64, @intCast(row));
+                if (y < 0 or y >= self.height) continue;
+
+                for (0..width) |column| {
+                    const x = x0 + @as(i64, @intCast(column));
+                    if (x < 0 or x >= self.width) continue;
+
+                    // Position of the pixel center in the glyph (in texels).
+                    const u = (@as(f32, @floatFromInt(column)) + 0.5) / instance.scale;
+                    const v = (@as(f32, @floatFromInt(row)) + 0.5) / instance.scale;
+
+                    const color: [4]f32 = switch (instance.mode) {
+                        .coverage => tint(instance.color, unorm(source.nearest(u, v)[0])),
+                        .color => blk: {
+                            const texel = source.nearest(u, v);
+                            break :blk .{
+                                unorm(texel[0]),
+                                unorm(texel[1]),
+                                unorm(texel[2]),
+                                unorm(texel[3]) * unorm(instance.color[3]),
+                            };
+                        },
+                        .sdf => blk: {
+                            // Same as the shader: 0.5 is the outline, antialiased over one pixel.
+                            const distance = source.bilinear(u, v);
+                            const edge_width = 0.5 / (glyph_cache.SDF_SPREAD * instance.scale);
+                            break :blk tint(instance.color, std.math.clamp((distance - 0.5) / edge_width + 0.5, 0, 1));
+                        },
+                    };
+
+                    const offset: usize = @intCast((y * self.width + x) * 4);
+                    blend(self.pixels[offset..][0..4], color);
+                }
+            }
+        }
+    }
+
+    pub fn writePng(self: *const Canvas, path: [:0]const u8) !void {
+        const result = stb_image_write.c.stbi_write_png(
+            path.ptr,
+            @intCast(self.width),
+            @intCast(self.height),
+            4,
+            self.pixels.ptr,
+            @intCast(self.width * 4),
+        );
+        if (result == 0) return error.WritePng;
+    }
+
+    /// Save pixels losslessly as a PAM image, used for reference images as it's trivial to read back.
+    pub fn writePam(self: *const Canvas, path: []const u8) !void {
+        const file = try std.fs.cwd().createFile(path, .{});
+        defer file.close();
+
+        var buffered = std.io.bufferedWriter(file.writer());
+        try buffered.writer().print(
+            "P7\nWIDTH {d}\nHEIGHT {d}\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+            .{ self.width, self.height },
+        );
+        try buffered.writer().writeAll(self.pixels);
+        try buffered.flush();
+    }
+
+    /// Read an image saved with `writePam()`.
+    pub fn readPam(allocator: Allocator, path: []const u8) !Canvas {
+        const bytes = try std.fs.cwd().readFileAlloc(allocator, path, std.math.maxInt(u32));
+        defer allocator.free(bytes);
+
+        var width: ?u32 = null;
+        var height: ?u32 = null;
+        var offset: usize = 0;
+        while (true) {
+            const end = std.mem.indexOfScalarPos(u8, bytes, offset, '\n') orelse return error.InvalidPam;
+            const line = bytes[offset..end];
+            offset = end + 1;
+
+            if (std.mem.eql(u8, line, "ENDHDR")) break;
+            var words = std.mem.tokenizeScalar(u8, line, ' ');
+            const name = words.next() orelse continue;
+            const value = words.next() orelse continue;
+            if (std.mem.eql(u8, name, "WIDTH")) width = try std.fmt.parseInt(u32, value, 10);
+            if (std.mem.eql(u8, name, "HEIGHT")) height = try std.fmt.parseInt(u32, value, 10);
+            if (std.mem.eql(u8, name, "DEPTH") and !std.mem.eql(u8, value, "4")) return error.InvalidPam;
+        }
+
+        var canvas = try Canvas.init(allocator, width orelse return error.InvalidPam, height orelse return error.InvalidPam);
+        errdefer canvas.deinit();
+        if (bytes.len - offset != canvas.pixels.len) return error.InvalidPam;
+        @memcpy(canvas.pixels, bytes[offset..]);
+        return canvas;
+    }
+
+    /// Count pixels where any channel differs by more than `tolerance`. Images of different sizes differ everywhere.
+    pub fn diff(self: *const Canvas, other: *const Canvas, tolerance: u8) usize {
+        if (self.width != other.width or self.height != other.height) {
+            return @max(self.width * self.height, other.width * other.height);
+        }
+        var count: usize = 0;
+        var i: usize = 0;
+        while (i < self.pixels.len) : (i += 4) {
+            for (self.pixels[i..][0..4], other.pixels[i..][0..4]) |a, b| {
+                if (@max(a, b) - @min(a, b) > tolerance) {
+                    count += 1;
+                    break;
+                }
+            }
+        }
+        return count;
+    }
+};
+
+/// Glyph rectangle in an atlas page.
+const Source = struct {
+    pixels: []const u8,
+    page_size: u32,
+    bytes_per_pixel: u32,
+    rect: [4]u16,
+
+    fn texel(self: Source, x: u32, y: u32) []const u8 {
+        const offset = ((self.rect[1] + y) * self.page_size + self.rect[0] + x) * self.bytes_per_pixel;
+        return self.pixels[offset..][0..self.bytes_per_pixel];
+    }
+
+    fn nearest(self: Source, u: f32, v: f32) []const u8 {
+        const x: u32 = @intFromFloat(std.math.clamp(@floor(u), 0, @as(f32, @floatFromInt(self.rect[2] - 1))));
+        const y: u32 = @intFromFloat(std.math.clamp(@floor(v), 0, @as(f32, @floatFromInt(self.rect[3] - 1))));
+        return self.texel(x, y);
+    }
+
+    /// Interpolate the first channel between the four closest texels, as a linear sampler would.
+    fn bilinear(self: Source, u: f32, v: f32) f32 {
+        const max_x: f32 = @floatFromInt(self.rect[2] - 1);
+        const max_y: f32 = @floatFromInt(self.rect[3] - 1);
+        const fx = std.math.clamp(u - 0.5, 0, max_x);
+        const fy = std.math.clamp(v - 0.5, 0, max_y);
+
+        const x0: u32 = @intFromFloat(@floor(fx));
+        const y0: u32 = @intFromFloat(@floor(fy));
+        const x1: u32 = @intFromFloat(@min(@floor(fx) + 1, max_x));
+        const y1: u32 = @intFromFloat(@min(@floor(fy) + 1, max_y));
+        const tx = fx - @floor(fx);
+        const ty = fy - @floor(fy);
+
+        const top = std.math.lerp(unorm(self.texel(x0, y0)[0]), unorm(self.texel(x1, y0)[0]), tx);
+        const bottom = std.math.lerp(unorm(self.texel(x0, y1)[0]), unorm(self.texel(x1, y1)[0]), tx);
+        return std.math.lerp(top, bottom, ty);
+    }
+};
+
+fn unorm(value: u8) f32 {
+    return @as(f32, @floatFromInt(value)) / 255;
+}
+
+fn tint(color: [4]u8, coverage: f32) [4]f32 {
+    return .{ unorm(color[0]), unorm(color[1]), unorm(color[2]), unorm(color[3]) * coverage };
+}
+
+/// Color: src * src_alpha + dst * (1 - src_alpha). Alpha: src + dst * (1 - src_alpha).
+fn blend(dst: *[4]u8, src: [4]f32) void {
+    const a = src[3];
+    for (0..3) |i| {
+        dst[i] = @intFromFloat(@round((src[i] * a + unorm(dst[i]) * (1 - a)) * 255));
+    }
+    dst[3] = @intFromFloat(@round((a + unorm(dst[3]) * (1 - a)) * 255));
+}
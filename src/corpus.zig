@@ -0,0 +1,58 @@
+/// Sample texts used by the benchmark. Each corpus is a list of lines rendered one below another.
+pub const Corpus = struct {
+    name: []const u8,
+    lines: []const []const u8,
+};
+
+pub const all = [_]Corpus{
+    .{
+        .name = "latin",
+        .lines = &.{
+            "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Ut gravida, sem vel facilisis porttitor,",
+            "tortor diam suscipit ipsum, at tristique nulla urna in ex. In hac habitasse platea dictumst.",
+            "Cras faucibus ut dolor eu ornare. Donec eu rutrum elit. Nunc vitae libero sollicitudin, dictum",
+            "quam quis, accumsan dui. Sed congue euismod dui, finibus semper quam feugiat consectetur.",
+            "Zażółć gęślą jaźń. Příliš žluťoučký kůň úpěl ďábelské ódy. Façade, naïve, déjà vu, smörgåsbord.",
+            "The quick brown fox jumps over the lazy dog 0123456789 (!?) [a-z] {A-Z} @#$%&*+=/\\|<>~",
+        },
+    },
+    .{
+        .name = "devanagari",
+        .lines = &.{
+            "नमस्ते, आप कैसे हैं?",
+            "सभी मनुष्यों को गौरव और अधिकारों के मामले में जन्मजात स्वतन्त्रता और समानता प्राप्त है।",
+            "उन्हें बुद्धि और अन्तरात्मा की देन प्राप्त है और परस्पर उन्हें भाईचारे के भाव से बर्ताव करना चाहिए।",
+            "क्षत्रिय, ज्ञान, श्रृंखला, द्वार, ह्रदय, स्त्री, प्रश्न",
+        },
+    },
+    .{
+        .name = "arabic",
+        .lines = &.{
+            "مرحبًا، كيف حالك؟",
+            "لمّا كان الاعتراف بالكرامة المتأصلة في جميع أعضاء الأسرة البشرية",
+            "وبحقوقهم المتساوية الثابتة هو أساس الحرية والعدل والسلام في العالم",
+            "يولد جميع الناس أحرارًا متساوين في الكرامة والحقوق",
+        },
+    },
+    .{
+        .name = "cjk",
+        .lines = &.{
+            "こんにちは ラーメン",
+            "もしもし おげんきですか",
+            "いろはにほへと ちりぬるを わかよたれそ つねならむ",
+            "アイウエオ カキクケコ サシスセソ タチツテト ナニヌネノ",
+            "ハヒフヘホ マミムメモ ヤユヨ ラリルレロ ワヲン",
+            "すべての人間は、生まれながらにして自由であり、かつ、尊厳と権利とについて平等である。",
+            "모든 인간은 태어날 때부터 자유로우며 그 존엄과 권리에 있어 동등하다.",
+        },
+    },
+    .{
+        .name = "emoji",
+        .lines = &.{
+            "👋😀🎷🇯🇵☝🏾",
+            "😂🥲😍🤔😴🤯🥳😎🤖👻💩🙈🙉🙊",
+            "👨‍👩‍👧‍👦 👩🏽‍💻 🧑🏿‍🚀 🏳️‍🌈 🇵🇱🇺🇦🇮🇳🇸🇦",
+            "🍕🍣🍜🍩☕🍺⚽🏀🎸🎹🚀✈️🌍🌙⭐🔥",
+        },
+    },
+};
@@ -0,0 +1,87 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const ft = @import("mach-freetype");
+
+/// Number of Unicode codepoints.
+const CODEPOINT_COUNT = 0x110000;
+const BLOCK_SIZE = 256;
+const BLOCK_COUNT = CODEPOINT_COUNT / BLOCK_SIZE;
+
+const Page = std.StaticBitSet(BLOCK_SIZE);
+const EMPTY_PAGE = 0;
+const FULL_PAGE = 1;
+
+/// Set of codepoints a font has glyphs for, read from its cmap once when the font is loaded. The codespace is split
+/// into blocks of 256 codepoints, each pointing to a bitset of the block. Blocks the font doesn't touch share the empty
+/// bitset, so a font costs 8.5 KiB plus 32 bytes per partially covered block, and a lookup is two loads.
+pub const Coverage = struct {
+    allocator: Allocator,
+    blocks: []u16, // Index into `pages` for each block.
+    pages: []Page,
+    count: usize, // Number of covered codepoints.
+
+    /// Build the index from the selected (Unicode) charmap of the face.
+    pub fn init(allocator: Allocator, face: ft.Face) !Coverage {
+        var pages = std.ArrayList(Page).init(allocator);
+        defer pages.deinit();
+        try pages.appendSlice(&.{ Page.initEmpty(), Page.initFull() });
+
+        const blocks = try allocator.alloc(u16, BLOCK_COUNT);
+        errdefer allocator.free(blocks);
+        @memset(blocks, EMPTY_PAGE);
+
+        // FreeType returns codepoints in increasing order, so each block is filled in one go.
+        var page = Page.initEmpty();
+        var block: ?usize = null;
+        var count: usize = 0;
+        var charmap = face.iterateCharmap();
+        var next: ?u32 = if (charmap.index != 0) charmap.charcode else null;
+        while (next) |codepoint| : (next = charmap.next()) {
+            if (codepoint >= CODEPOINT_COUNT) break;
+            const current = codepoint / BLOCK_SIZE;
+            if (block != null and block.? != current) {
+                blocks[block.?] = try addPage(&pages, page);
+                page = Page.initEmpty();
+            }
+            block = current;
+            page.set(codepoint % BLOCK_SIZE);
+            count += 1;
+        }
+        if (block) |last| blocks[last] = try addPage(&pages, page);
+
+        return .{
+            .allocator = allocator,
+            .blocks = blocks,
+            .pages = try pages.toOwnedSlice(),
+            .count = count,
+        };
+    }
+
+    pub fn deinit(self: *Coverage) void {
+        self.allocator.free(self.blocks);
+        self.allocator.free(self.pages);
+    }
+
+    pub fn contains(self: *const Coverage, codepoint: u21) bool {
+        if (codepoint >= CODEPOINT_COUNT) return false;
+        return self.pages[self.blocks[codepoint / BLOCK_SIZE]].isSet(codepoint % BLOCK_SIZE);
+    }
+
+    /// Whether all codepoints from `first` to `last` (inclusive) are covered.
+    pub fn containsRange(self: *const Coverage, first: u21, last: u21) bool {
+        var codepoint = first;
+        while (codepoint <= last) : (codepoint += 1) {
+            if (!self.contains(codepoint)) return false;
+        }
+        return true;
+    }
+};
+
+/// Index of the page with the same bits, appending it if it's not one of the shared ones. Fonts often cover whole
+/// blocks (CJK ideographs, Hangul syllables) so those don't take any space.
+fn addPage(pages: *std.ArrayList(Page), page: Page) !u16 {
+    if (page.eql(pages.items[FULL_PAGE])) return FULL_PAGE;
+    if (page.eql(pages.items[pages.items.len - 1])) return @intCast(pages.items.len - 1);
+    try pages.append(page);
+    return @intCast(pages.items.len - 1);
+}
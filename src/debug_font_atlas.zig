@@ -23,12 +23,12 @@ const wgsl_fs =
     \\
     \\ @fragment
     \\ fn main(@builtin(position) position: vec4f, @location(0) uv: vec2f) -> @location(0) vec4f {
-    \\     let color = textureSample(myTexture, mySampler, uv).rgba;
-    \\     return color;
+    \\     let coverage = textureSample(myTexture, mySampler, uv).r;
+    \\     return vec4f(1.0, 1.0, 1.0, coverage);
     \\ }
 ;
 
-/// Displays font atlas in the top right corner (stretching to [0,1]^2 in the clip space).
+/// Displays first page of the grayscale font atlas in the top right corner (stretching to [0,1]^2 in the clip space).
 pub const DebugFontAtlas = struct {
     gctx: *zgpu.GraphicsContext,
     pipeline: zgpu.RenderPipelineHandle,
@@ -116,7 +116,11 @@ pub const DebugFontAtlas = struct {
             .max_anisotropy = 1,
         });
 
-        const atlas_texture_view = gctx.createTextureView(atlas_texture, .{});
+        const atlas_texture_view = gctx.createTextureView(atlas_texture, .{
+            .dimension = .tvdim_2d,
+            .base_array_layer = 0,
+            .array_layer_count = 1,
+        });
 
         const bind_group = gctx.createBindGroup(bind_group_layout, &.{
             .{ .binding = 0, .texture_view_handle = atlas_texture_view },
@@ -1,29 +1,41 @@
 const std = @import("std");
 const Allocator = std.mem.Allocator;
-const zgpu = @import("zgpu");
 const ft = @import("mach-freetype");
 const hb = @import("mach-harfbuzz");
-// const icu4x = @import("icu4zig");
 const plutosvg = @import("plutosvg.zig");
 const stb_image_write = @import("stb_image_write");
-const stb_rect_pack = @import("stb_rect_pack");
-
-/// Margin around each glyph in the atlas.
-const MARGIN_PX = 1;
-
-const font_size = 18;
-
-const FontMapping = enum(usize) {
+const glyph_cache = @import("glyph_cache.zig");
+const atlas_file = @import("atlas_file.zig");
+const Rasterizer = @import("rasterizer.zig").Rasterizer;
+const shape_cache = @import("shape_cache.zig");
+const Coverage = @import("coverage.zig").Coverage;
+const ShapeCache = shape_cache.ShapeCache;
+const ShapedGlyph = shape_cache.ShapedGlyph;
+const GlyphCache = glyph_cache.GlyphCache;
+const GlyphKey = glyph_cache.GlyphKey;
+pub const GlyphInfo = glyph_cache.GlyphInfo;
+pub const Format = glyph_cache.Format;
+
+/// Default text size (in logical px).
+pub const font_size = 18;
+
+/// Atlas pages and glyph metrics are stored there between runs.
+const ATLAS_CACHE_PATH = "font_atlas.cache";
+
+/// Font faces bundled with the app, by index in `FontLibrary.fonts`.
+pub const FontMapping = enum(u16) {
     Latin = 0,
     Arabic = 1,
     Japanese = 2,
-    Emoji = 3,
+    Korean = 3,
+    Emoji = 4,
 };
 
 const RGBA = struct { r: u8, g: u8, b: u8, a: u8 };
 
-const Range = struct {
+pub const Range = struct {
     script: hb.Script, // Script used by the range.
+    font: u16, // Index in `FontLibrary.fonts`.
     start: usize, // First byte index.
     end: usize, // Last byte index (inclusive).
     // color: RGBA, <- Styling will probably go here into the ranges.
@@ -34,16 +46,8 @@ pub const GlyphShape = struct {
     x: i32, // x position after shaping (in px).
     y: i32,
     glyph: GlyphInfo,
-};
-
-pub const GlyphInfo = struct {
-    x: i32, // The x position in the atlas (in px).
-    y: i32,
-    width: i32, // Width of the glyph in the bitmap (in px).
-    height: i32,
-    bearing_x: i32, // Offset from the left edge of the bitmap to where the glyph starts (in px).
-    bearing_y: i32,
-    pixel_mode: ft.PixelMode,
+    scale: f32, // Size of the quad relative to the glyph in the atlas. Only distance fields are drawn scaled.
+    key: GlyphKey, // Looks up `glyph` again if the atlas was modified since shaping.
 };
 
 var last_step: i128 = 0;
@@ -53,373 +57,593 @@ fn logTime(message: []const u8) void {
     last_step = now;
 }
 
-const GlyphMap = std.AutoHashMap(u32, GlyphInfo);
-
 pub const Font = struct {
+    data: []const u8, // Font file contents.
     ft_face: ft.Face,
     hb_face: hb.Face,
     hb_font: hb.Font,
-    glyphs: GlyphMap,
+    pixel_size: u32, // Size currently selected in `ft_face`.
+    sdf: bool, // Render signed distance fields instead of coverage. Only for outline (not color) faces.
 
-    pub fn init(allocator: Allocator, ft_lib: *ft.Library, data: []const u8) !Font {
+    pub fn init(ft_lib: *ft.Library, data: []const u8) !Font {
         const ft_face = try ft_lib.createFaceMemory(data, 0);
         const hb_face = hb.Face.fromFreetypeFace(ft_face);
         const hb_font = hb.Font.init(hb_face);
         return Font{
+            .data = data,
             .ft_face = ft_face,
             .hb_face = hb_face,
             .hb_font = hb_font,
-            .glyphs = GlyphMap.init(allocator),
+            .pixel_size = 0,
+            .sdf = false,
+        };
+    }
+
+    pub fn deinit(self: *Font) void {
+        self.hb_font.deinit();
+        self.ft_face.deinit();
+    }
+
+    /// Render the glyph with FreeType. Returned bitmap is owned by the face and valid until the next call.
+    pub fn renderGlyph(self: *Font, glyph_id: u32, pixel_size: u32) !glyph_cache.Bitmap {
+        if (self.pixel_size != pixel_size) {
+            try self.ft_face.setPixelSizes(0, pixel_size);
+            self.pixel_size = pixel_size;
+        }
+
+        const ft_glyph = self.ft_face.glyph();
+        if (self.sdf) {
+            // Distance fields are scaled to every size, hinting to the grid of the reference size would distort them.
+            try self.ft_face.loadGlyph(glyph_id, .{ .no_hinting = true });
+            try ft_glyph.render(.sdf);
+        } else {
+            try self.ft_face.loadGlyph(glyph_id, .{ .render = true, .color = self.ft_face.hasColor() });
+        }
+        const ft_bitmap = ft_glyph.bitmap();
+
+        return .{
+            .width = ft_bitmap.width(),
+            .rows = ft_bitmap.rows(),
+            .pitch = ft_bitmap.pitch(),
+            .pixel_mode = ft_bitmap.pixelMode(),
+            .buffer = ft_bitmap.buffer() orelse &.{},
+            .left = ft_glyph.bitmapLeft(),
+            .top = ft_glyph.bitmapTop(),
+            .sdf = self.sdf,
         };
     }
 };
 
+/// Set up modules of a FreeType library used to render glyphs: OT SVG rendering and distance field spread.
+pub fn configureLibrary(ft_lib: *ft.Library) !void {
+    const hooks = plutosvg.c.plutosvg_ft_svg_hooks() orelse return error.PlutoSVG;
+    try ft_lib.setProperty("ot-svg", "svg-hooks", hooks);
+
+    const spread: c_int = glyph_cache.SDF_SPREAD;
+    try ft_lib.setProperty("sdf", "spread", &spread);
+}
+
 const latin = @embedFile("./assets/NotoSans-Regular.ttf");
 const ar = @embedFile("./assets/NotoSansArabic-Regular.ttf");
 const jp = @embedFile("./assets/NotoSansJP-Regular.ttf");
 const kr = @embedFile("./assets/NotoSansKR-Regular.ttf");
 const emoji = @embedFile("./assets/NotoColorEmoji-COLRv1.ttf");
 
-/// Font encapsulates FreeType and HarfBuzz logic for shaping text. Generates font atlas texture in the `init()` method.
+/// Font encapsulates FreeType and HarfBuzz logic for shaping text. Glyphs are rasterized into the atlas lazily, the
+/// first time `shape()` produces them. The library doesn't touch the GPU, uploading the atlas is up to the renderer (see
+/// `GpuAtlas`).
 pub const FontLibrary = struct {
     allocator: Allocator,
 
-    gctx: *zgpu.GraphicsContext,
-
     ft_lib: ft.Library,
     fonts: []Font,
-    atlas_texture: zgpu.TextureHandle,
-    atlas_size: u32,
+    coverages: []Coverage, // Codepoints of each font.
+    fallback: []u16, // Fonts tried in order for each codepoint.
+    ascii_font: ?u16, // Font the fallback chain picks for all of printable ASCII, if it's the same one.
+    unicode_funcs: *hb.c.hb_unicode_funcs_t,
+    glyph_cache: GlyphCache,
+    rasterizer: Rasterizer,
+    shape_cache: ShapeCache,
+    buffers: shape_cache.BufferPool,
+    shaped: std.ArrayList(ShapedGlyph), // Scratch space for runs shaped in `shape()`.
+    atlas_key: u64, // Identifies content of the atlas cache file.
+    cache_path: ?[]const u8,
+    sdf_size: ?u16, // Reference size of distance field glyphs, null when rendering coverage.
     dpr: u32,
 
-    pub fn init(allocator: Allocator, gctx: *zgpu.GraphicsContext, dpr: u32) !FontLibrary {
+    pub const Options = struct {
+        /// Number of threads used to rasterize glyphs. Defaults to the number of CPU cores.
+        thread_count: ?u32 = null,
+        /// Memory budget for shaped runs kept between frames.
+        shape_cache_bytes: usize = 1024 * 1024,
+        /// File the atlas is restored from and saved to. Null disables the cache file.
+        cache_path: ?[]const u8 = ATLAS_CACHE_PATH,
+        /// Rasterize outline fonts as signed distance fields at `sdf_size` and scale them to the requested size when
+        /// drawing, so one atlas entry serves every text size. Color fonts are always rasterized at the exact size.
+        sdf: bool = false,
+        sdf_size: u16 = 32,
+        /// Fonts tried in order for each codepoint, the first one with a glyph for it is used. Emoji presentation
+        /// sequences try color fonts first.
+        fallback: []const FontMapping = &.{ .Latin, .Arabic, .Japanese, .Korean, .Emoji },
+    };
+
+    pub fn init(allocator: Allocator, dpr: u32, options: Options) !FontLibrary {
+        if (options.fallback.len == 0) return error.EmptyFallback;
+
+        last_step = std.time.nanoTimestamp();
         var ft_lib = try ft.Library.init();
+        errdefer ft_lib.deinit();
         const v = ft_lib.version();
         std.debug.print("FreeType version: {d}.{d}.{d}\n", .{ v.major, v.minor, v.patch });
 
-        var fonts = try allocator.alloc(Font, 4);
-        fonts[0] = try Font.init(allocator, &ft_lib, latin);
-        fonts[1] = try Font.init(allocator, &ft_lib, ar);
-        fonts[2] = try Font.init(allocator, &ft_lib, jp);
-        // fonts[3] = try Font.init(allocator, &ft_lib, kr);
-        fonts[3] = try Font.init(allocator, &ft_lib, emoji);
+        const fonts = try allocator.alloc(Font, 5);
+        errdefer allocator.free(fonts);
+
+        var fonts_initialized: usize = 0;
+        errdefer {
+            for (fonts[0..fonts_initialized]) |*font| font.deinit();
+        }
+        const font_data = [_][]const u8{ latin, ar, jp, kr, emoji }; // Indexed by `FontMapping`.
+        for (fonts, font_data) |*font, data| {
+            font.* = try Font.init(&ft_lib, data);
+            fonts_initialized += 1;
+        }
+
+        try configureLibrary(&ft_lib);
+
+        const coverages = try allocator.alloc(Coverage, fonts.len);
+        errdefer allocator.free(coverages);
+
+        var coverages_initialized: usize = 0;
+        errdefer {
+            for (coverages[0..coverages_initialized]) |*coverage| coverage.deinit();
+        }
+        for (coverages, fonts) |*coverage, font| {
+            coverage.* = try Coverage.init(allocator, font.ft_face);
+            coverages_initialized += 1;
+        }
+        logTime("Reading font coverage");
 
-        const hooks = plutosvg.c.plutosvg_ft_svg_hooks() orelse return error.PlutoSVG;
-        try ft_lib.setProperty("ot-svg", "svg-hooks", hooks);
+        const fallback = try allocator.alloc(u16, options.fallback.len);
+        errdefer allocator.free(fallback);
+        for (fallback, options.fallback) |*id, mapping| id.* = @intFromEnum(mapping);
 
         for (fonts) |*font| {
             try font.ft_face.setPixelSizes(0, font_size * dpr);
+            font.pixel_size = font_size * dpr;
             const hb_font_size: i32 = font_size * @as(i32, @intCast(dpr)) * 64;
             font.hb_font.setScale(hb_font_size, hb_font_size);
-            font.glyphs = GlyphMap.init(allocator);
+            font.sdf = options.sdf and !font.ft_face.hasColor();
         }
 
-        const font_atlas = try generateFontAtlas(allocator, fonts);
-        defer allocator.free(font_atlas.bitmap);
-
-        // Write the atlas to disk.
-        {
-            // _ = stb_image_write.c.stbi_write_png(
-            //     "font_atlas.png",
-            //     @intCast(font_atlas.size),
-            //     @intCast(font_atlas.size),
-            //     4,
-            //     font_atlas.bitmap.ptr,
-            //     @intCast(font_atlas.size * 4),
-            // );
-            // logTime("Saving atlas to PNG");
+        const thread_count = options.thread_count orelse @as(u32, @intCast(std.Thread.getCpuCount() catch 1));
+        var rasterizer = try Rasterizer.init(allocator, fonts, thread_count);
+        errdefer rasterizer.deinit();
+        logTime("Starting rasterizer threads");
+
+        var cache = GlyphCache.init(allocator, .{});
+        errdefer cache.deinit();
+        const sdf_size: ?u16 = if (options.sdf) options.sdf_size else null;
+        const atlas_key = atlasKey(fonts, dpr, sdf_size);
+        if (options.cache_path) |path| {
+            const loaded = cache.load(path, atlas_key) catch |err| blk: {
+                std.debug.print("Failed to load atlas cache ({s})\n", .{@errorName(err)});
+                break :blk false;
+            };
+            logTime(if (loaded) "Loading atlas cache" else "Checking atlas cache");
         }
 
-        const atlas_texture = gctx.createTexture(.{
-            .usage = .{ .texture_binding = true, .copy_dst = true },
-            .size = .{
-                .width = font_atlas.size,
-                .height = font_atlas.size,
-                .depth_or_array_layers = 1,
-            },
-            .format = zgpu.imageInfoToTextureFormat(4, 1, false),
-        });
-
-        gctx.queue.writeTexture(
-            .{ .texture = gctx.lookupResource(atlas_texture).? },
-            .{ .bytes_per_row = font_atlas.size * 4, .rows_per_image = font_atlas.size },
-            .{ .width = font_atlas.size, .height = font_atlas.size },
-            u8,
-            font_atlas.bitmap,
-        );
-
-        logTime("Uploading texture to GPU");
-
         return FontLibrary{
             .allocator = allocator,
-            .gctx = gctx,
             .ft_lib = ft_lib,
             .fonts = fonts,
-            .atlas_texture = atlas_texture,
-            .atlas_size = font_atlas.size,
+            .coverages = coverages,
+            .fallback = fallback,
+            .ascii_font = asciiFont(coverages, fallback),
+            .unicode_funcs = hb.c.hb_unicode_funcs_get_default().?,
+            .glyph_cache = cache,
+            .rasterizer = rasterizer,
+            .shape_cache = ShapeCache.init(allocator, .{ .max_bytes = options.shape_cache_bytes }),
+            .buffers = shape_cache.BufferPool.init(allocator),
+            .shaped = std.ArrayList(ShapedGlyph).init(allocator),
+            .atlas_key = atlas_key,
+            .cache_path = options.cache_path,
+            .sdf_size = sdf_size,
             .dpr = dpr,
         };
     }
 
     pub fn deinit(self: *FontLibrary) void {
+        self.rasterizer.deinit();
+        self.shape_cache.deinit();
+        self.buffers.deinit();
+        self.shaped.deinit();
         for (self.fonts) |*font| {
-            font.hb_font.deinit();
-            font.ft_face.deinit();
-            font.glyphs.deinit();
+            font.deinit();
         }
         self.allocator.free(self.fonts);
+        for (self.coverages) |*coverage| {
+            coverage.deinit();
+        }
+        self.allocator.free(self.coverages);
+        self.allocator.free(self.fallback);
+        // The file is left alone if every glyph came from it.
+        if (self.cache_path != null and self.glyph_cache.modified) {
+            self.glyph_cache.save(self.cache_path.?, self.atlas_key) catch |err| {
+                std.debug.print("Failed to save atlas cache ({s})\n", .{@errorName(err)});
+            };
+        }
+        self.glyph_cache.deinit();
         self.ft_lib.deinit();
-        self.gctx.releaseResource(self.atlas_texture);
+    }
+
+    /// Return atlas entry for the glyph, rasterizing it on first use.
+    pub fn getGlyph(self: *FontLibrary, key: GlyphKey) !GlyphInfo {
+        if (self.glyph_cache.get(key)) |info| {
+            return info;
+        }
+        const bitmap = try self.fonts[key.font].renderGlyph(key.glyph_id, key.size);
+        return self.glyph_cache.insert(key, bitmap);
+    }
+
+    /// Rasterize all glyphs that are not in the atlas yet, using multiple threads for large batches.
+    pub fn rasterize(self: *FontLibrary, keys: []const GlyphKey) !void {
+        try self.rasterizer.rasterize(self.fonts, &self.glyph_cache, keys);
+    }
+
+    /// Rasterize a batch like `rasterize()`, except that a full atlas doesn't fail the frame: if every page is in use
+    /// by the current frame, glyphs that didn't fit are skipped (keeping their advance). Returns false in that case,
+    /// and the caller has to request the glyphs again in a later frame. Look the glyphs up with `lookupGlyph()`
+    /// afterwards.
+    pub fn rasterizeAvailable(self: *FontLibrary, keys: []const GlyphKey) !bool {
+        self.rasterize(keys) catch |err| switch (err) {
+            error.AtlasFull => {
+                std.debug.print("Atlas is full, skipping glyphs\n", .{});
+                return false;
+            },
+            else => return err,
+        };
+        return true;
+    }
+
+    /// Atlas entry of a glyph from a batch passed to `rasterizeAvailable()`, which returned `rasterized`. Null if the
+    /// glyph was skipped or can't be rendered.
+    pub fn lookupGlyph(self: *FontLibrary, key: GlyphKey, rasterized: bool) ?GlyphInfo {
+        if (!rasterized) return self.glyph_cache.get(key);
+        return self.getGlyph(key) catch |err| {
+            std.debug.print("No glyph for {d} ({s})\n", .{ key.glyph_id, @errorName(err) });
+            return null;
+        };
+    }
+
+    /// First font of the fallback chain that has a glyph for the codepoint. Null if none of them has.
+    pub fn fontFor(self: *const FontLibrary, codepoint: u21, emoji_presentation: bool) ?u16 {
+        if (emoji_presentation) {
+            for (self.fallback) |id| {
+                if (self.fonts[id].ft_face.hasColor() and self.coverages[id].contains(codepoint)) return id;
+            }
+        }
+        for (self.fallback) |id| {
+            if (self.coverages[id].contains(codepoint)) return id;
+        }
+        return null;
     }
 };
 
-pub fn shape(allocator: Allocator, fonts: []Font, value: []const u8, max_width: i32) ![]GlyphShape {
-    _ = max_width; // autofix
-    const ranges = try getRanges(allocator, value);
-    defer allocator.free(ranges);
+/// Font picked for every ASCII letter by the fallback chain, if that font also covers the rest of printable ASCII.
+/// Itemization skips over ASCII that stays in such a font without looking at each codepoint.
+fn asciiFont(coverages: []const Coverage, fallback: []const u16) ?u16 {
+    var font: ?u16 = null;
+    for ("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz") |letter| {
+        const id = for (fallback) |candidate| {
+            if (coverages[candidate].contains(letter)) break candidate;
+        } else return null;
+        if (font != null and font.? != id) return null;
+        font = id;
+    }
+    if (!coverages[font.?].containsRange(0x20, 0x7E)) return null;
+    return font;
+}
+
+/// Hash of everything that affects content of the atlas. Cache file created with a different key is ignored.
+fn atlasKey(fonts: []const Font, dpr: u32, sdf_size: ?u16) u64 {
+    var hasher = std.hash.Wyhash.init(atlas_file.VERSION);
+    for (fonts) |font| {
+        hasher.update(font.data);
+    }
+    const settings = [_]u32{ font_size, dpr, glyph_cache.MARGIN_PX, sdf_size orelse 0, glyph_cache.SDF_SPREAD };
+    hasher.update(std.mem.sliceAsBytes(&settings));
+    return hasher.final();
+}
 
+/// Shape a single line of text set in `size` (in logical px) and make sure all its glyphs are in the atlas. See `Layout`
+/// for wrapping and bidirectional text.
+pub fn shape(allocator: Allocator, library: *FontLibrary, value: []const u8, size: u16) ![]GlyphShape {
     var shapes = std.ArrayList(GlyphShape).init(allocator);
-    var cursor_x: i32 = 0;
-    var cursor_y: i32 = 0;
+    errdefer shapes.deinit();
+    _ = try appendShapes(&shapes, library, value, size, false);
+    return shapes.toOwnedSlice();
+}
 
-    const segments = try segment(allocator, value);
-    defer allocator.free(segments);
+/// Shape text like `shape()` and append its glyphs to `shapes`, placed relative to the pen starting at (0, 0). If `rtl`
+/// is set, single-script ranges are placed right to left (for text at an odd bidi level). Returns false if glyphs were
+/// left out because the atlas is full, the text has to be shaped again in a later frame to get them.
+pub fn appendShapes(
+    shapes: *std.ArrayList(GlyphShape),
+    library: *FontLibrary,
+    value: []const u8,
+    size: u16,
+    rtl: bool,
+) !bool {
+    const allocator = shapes.allocator;
+    var positions = std.ArrayList(GlyphPosition).init(allocator);
+    defer positions.deinit();
+    _ = try appendGlyphPositions(&positions, library, value, size, rtl);
+
+    const keys = try allocator.alloc(GlyphKey, positions.items.len);
+    defer allocator.free(keys);
+    for (positions.items, keys) |position, *key| {
+        key.* = position.key;
+    }
+    const rasterized = try library.rasterizeAvailable(keys);
+
+    const pixel_size: u16 = @intCast(size * library.dpr);
+    try shapes.ensureUnusedCapacity(positions.items.len);
+    for (positions.items) |position| {
+        const glyph = library.lookupGlyph(position.key, rasterized) orelse continue;
+        shapes.appendAssumeCapacity(placeGlyph(position, glyph, pixel_size, 0, 0));
+    }
+    return rasterized;
+}
 
-    for (ranges) |range| {
-        var buffer = hb.Buffer.init() orelse return error.OutOfMemory;
-        defer buffer.deinit();
+/// Shaped glyph that isn't looked up in the atlas yet.
+pub const GlyphPosition = struct {
+    key: GlyphKey,
+    x: i32, // Pen position plus offset from shaping, without the bearing of the glyph (in px).
+    y: i32,
+};
 
-        // buffer.guessSegmentProps();
-        // buffer.setLanguage(hb.Language.fromString("hi"));
-        buffer.setDirection(scriptToDirection(range.script));
-        buffer.setScript(range.script);
+/// Shape text like `appendShapes()` without rasterizing anything, so that text can be measured and broken into lines
+/// before knowing which glyphs are drawn. Returns the horizontal advance (in px).
+pub fn appendGlyphPositions(
+    positions: *std.ArrayList(GlyphPosition),
+    library: *FontLibrary,
+    value: []const u8,
+    size: u16,
+    rtl: bool,
+) !i32 {
+    const ranges = try getRanges(positions.allocator, library, value);
+    defer positions.allocator.free(ranges);
 
-        buffer.addUTF8(value[range.start .. range.end + 1], 0, null);
+    var cursor_x: i32 = 0;
+    var cursor_y: i32 = 0;
 
-        const fontId = scriptToFont(range.script) orelse {
-            std.debug.print("No font for script {d}\n", .{@intFromEnum(range.script)});
-            continue;
-        };
+    const pixel_size: u16 = @intCast(size * library.dpr);
 
-        fonts[fontId].hb_font.shape(buffer, null);
+    for (0..ranges.len) |i| {
+        const range = ranges[if (rtl) ranges.len - 1 - i else i];
+        const fontId = range.font;
 
-        const infos = buffer.getGlyphInfos();
-        const positions = buffer.getGlyphPositions() orelse return error.OutOfMemory;
+        const run = try shapeRun(library, .{
+            .text = value[range.start .. range.end + 1],
+            .font = fontId,
+            .script = range.script,
+            .direction = scriptToDirection(range.script),
+            .size = pixel_size,
+        });
 
-        for (positions, infos) |pos, info| {
-            // After shaping info.codepoint is a glyph index not unicode point.
-            const glyph = fonts[fontId].glyphs.get(info.codepoint) orelse {
-                std.debug.print("No glyph for {d}\n", .{info.codepoint});
-                continue;
-            };
+        // Distance fields are rendered once at the reference size and scaled.
+        const glyph_size = if (library.fonts[fontId].sdf) library.sdf_size.? else pixel_size;
 
-            try shapes.append(GlyphShape{
-                .x = cursor_x + (pos.x_offset >> 6) + glyph.bearing_x,
-                .y = cursor_y + (pos.y_offset >> 6) - glyph.bearing_y,
-                .glyph = glyph,
+        try positions.ensureUnusedCapacity(run.len);
+        for (run) |pos| {
+            positions.appendAssumeCapacity(.{
+                .key = .{ .font = fontId, .glyph_id = pos.glyph_id, .size = glyph_size },
+                .x = cursor_x + (pos.x_offset >> 6),
+                .y = cursor_y + (pos.y_offset >> 6),
             });
             cursor_x += pos.x_advance >> 6;
             cursor_y += pos.y_advance >> 6;
         }
     }
-    std.debug.print("\n", .{});
-    return shapes.toOwnedSlice();
+    return cursor_x;
 }
 
-/// Map Unicode codepoint to HarfBuzz script that will be used for shaping.
-fn codepointToScript(codepoint: u64) hb.Script {
-    return switch (codepoint) {
-        0x0020...0x007F, 0x00A0...0x00FF, 0x0100...0x017F, 0x0180...0x024F => hb.Script.latin,
-        0x0400...0x04FF => hb.Script.cyrillic,
-        0x0900...0x097F => hb.Script.devanagari,
-        0x0600...0x06FF => hb.Script.arabic,
-        0x3041...0x3096 => hb.Script.hiragana,
-        0x30A0...0x30FF => hb.Script.katakana,
-        // 0xAC00...0xD7AF, 0x1100...0x11FF, 0x3130...0x318F, 0xA960...0xA97F, 0xD7B0...0xD7FF => hb.Script.hangul,
-        else => hb.Script.common,
+/// Glyph drawn with the pen at (x, y) from its position after shaping and its atlas entry. Text is set in `pixel_size`
+/// (in px), distance fields are scaled to it.
+pub fn placeGlyph(position: GlyphPosition, glyph: GlyphInfo, pixel_size: u16, x: i32, y: i32) GlyphShape {
+    const scale = @as(f32, @floatFromInt(pixel_size)) / @as(f32, @floatFromInt(position.key.size));
+    return .{
+        .x = x + position.x + scaled(glyph.bearing_x, scale),
+        .y = y + position.y - scaled(glyph.bearing_y, scale),
+        .glyph = glyph,
+        .scale = scale,
+        .key = position.key,
     };
 }
 
-/// Map HarfBuzz script to font index.
-fn scriptToFont(script: hb.Script) ?usize {
-    return switch (script) {
-        hb.Script.latin => @intFromEnum(FontMapping.Latin),
-        hb.Script.cyrillic => @intFromEnum(FontMapping.Latin),
-        hb.Script.devanagari => @intFromEnum(FontMapping.Latin),
-        hb.Script.arabic => @intFromEnum(FontMapping.Arabic),
-        hb.Script.common => @intFromEnum(FontMapping.Emoji),
-        hb.Script.hiragana => @intFromEnum(FontMapping.Japanese),
-        hb.Script.katakana => @intFromEnum(FontMapping.Japanese),
-        // hb.Script.hangul => @intFromEnum(FontMapping.Korean),
-        else => null,
-    };
+fn scaled(value: i32, scale: f32) i32 {
+    return @intFromFloat(@round(@as(f32, @floatFromInt(value)) * scale));
 }
 
-/// Map HarfBuzz script to text direction.
-fn scriptToDirection(script: hb.Script) hb.Direction {
-    return switch (script) {
-        hb.Script.arabic, hb.Script.hebrew => hb.Direction.rtl,
-        else => hb.Direction.ltr,
-    };
-}
+/// Shape a single-script run with HarfBuzz, reusing the result from the shape cache when the same run was shaped
+/// before. Returned glyphs are valid until the next call.
+fn shapeRun(library: *FontLibrary, key: shape_cache.RunKey) ![]const ShapedGlyph {
+    if (library.shape_cache.get(key)) |glyphs| {
+        return glyphs;
+    }
 
-/// Generate font atlas texture from the input fonts.
-fn generateFontAtlas(allocator: Allocator, fonts: []Font) !struct { size: u32, bitmap: []u8 } {
-    logTime("Before init");
-    var all_characters_len: u64 = 0;
-    for (fonts) |f| {
-        const count = f.ft_face.numGlyphs();
-        std.debug.print("{s} ({d})\n", .{ f.ft_face.familyName() orelse "Unknown", count });
-        all_characters_len += count;
+    var buffer = try library.buffers.acquire();
+    defer library.buffers.release(&buffer);
+
+    // buffer.guessSegmentProps();
+    // buffer.setLanguage(hb.Language.fromString("hi"));
+    buffer.setDirection(key.direction);
+    buffer.setScript(key.script);
+    buffer.addUTF8(key.text, 0, null);
+
+    const hb_font_size: i32 = @as(i32, key.size) * 64;
+    library.fonts[key.font].hb_font.setScale(hb_font_size, hb_font_size);
+    library.fonts[key.font].hb_font.shape(buffer, null);
+
+    const infos = buffer.getGlyphInfos();
+    const positions = buffer.getGlyphPositions() orelse return error.OutOfMemory;
+
+    // After shaping info.codepoint is a glyph index not unicode point.
+    library.shaped.clearRetainingCapacity();
+    try library.shaped.ensureTotalCapacity(infos.len);
+    for (infos, positions) |info, pos| {
+        library.shaped.appendAssumeCapacity(.{
+            .glyph_id = info.codepoint,
+            .x_offset = pos.x_offset,
+            .y_offset = pos.y_offset,
+            .x_advance = pos.x_advance,
+            .y_advance = pos.y_advance,
+        });
     }
+    return library.shape_cache.put(key, library.shaped.items);
+}
 
-    std.debug.print("Total characters: {d}\n", .{all_characters_len});
+/// Map HarfBuzz script to text direction.
+fn scriptToDirection(script: hb.Script) hb.Direction {
+    return if (script.getHorizontalDirection() == .rtl) .rtl else .ltr;
+}
 
-    const sizes = try allocator.alloc([2]i32, all_characters_len);
-    defer allocator.free(sizes);
+/// Unicode script property of a codepoint, from the Unicode tables HarfBuzz is built with.
+fn codepointToScript(library: *const FontLibrary, codepoint: u21) hb.Script {
+    const value: u32 = @intCast(hb.c.hb_unicode_script(library.unicode_funcs, codepoint));
+    return std.meta.intToEnum(hb.Script, value) catch .unknown;
+}
 
-    // Iterate over ranges.
-    var i: u32 = 0;
-    for (fonts) |f| {
-        for (0..f.ft_face.numGlyphs()) |j| {
-            // For regular font it's not necessary to render the glyph to get size but for OT SVG it is.
-            try f.ft_face.loadGlyph(@intCast(j), .{
-                .render = true,
-                .color = f.ft_face.hasColor(),
-            });
-            const ft_glyph = f.ft_face.glyph();
-            const ft_bitmap = ft_glyph.bitmap();
-            const w = ft_bitmap.width();
-            const h = ft_bitmap.rows();
-
-            sizes[i] = if (w == 0 or h == 0) .{ 0, 0 } else .{
-                @intCast(w + MARGIN_PX * 2),
-                @intCast(h + MARGIN_PX * 2),
-            };
-            i += 1;
-        }
-    }
-    logTime("Gathering sizes");
+/// Scripts that don't start a range of their own: punctuation, digits, spaces and symbols (common), combining marks
+/// (inherited) and unassigned codepoints (unknown) take the script of the text around them.
+fn isNeutralScript(script: hb.Script) bool {
+    return script == .common or script == .inherited or script == .unknown;
+}
 
-    // This is purely for debugging.
-    var total_area: i32 = 0;
-    for (sizes) |s| {
-        total_area += s[0] * s[1];
-    }
-    std.debug.print("Total area: {d}px\n", .{total_area});
+/// Whether the codepoint continues the cluster before it (marks, joiners, variation selectors, emoji modifiers and
+/// tags), so it has to be shaped with the same font.
+fn extendsCluster(codepoint: u21, script: hb.Script) bool {
+    return script == .inherited or switch (codepoint) {
+        0x1F3FB...0x1F3FF, 0xE0020...0xE007F => true,
+        else => false,
+    };
+}
 
-    const ATLAS_SIZE = 8100;
-    const packing = .{
-        .size = ATLAS_SIZE,
-        .positions = try packAtlas(allocator, sizes, ATLAS_SIZE),
+/// Whether the codepoint is drawn as emoji: it has emoji presentation by default or is followed by the emoji variation
+/// selector, a skin tone modifier or the keycap mark.
+fn isEmojiPresentation(codepoint: u21, next: ?u21) bool {
+    if (next) |following| switch (following) {
+        0xFE0F, 0x20E3, 0x1F3FB...0x1F3FF => return true,
+        0xFE0E => return false,
+        else => {},
     };
-    defer allocator.free(packing.positions);
-
-    logTime("Packing atlas");
-
-    const bitmap = try allocator.alloc(u8, @intCast(packing.size * packing.size * 4));
-    @memset(bitmap, 0); // Clear the bitmap.
-
-    // Once positions are known, we can generate the glyphs mapping and bitmap.
-    i = 0;
-    for (fonts) |*f| {
-        for (0..f.ft_face.numGlyphs()) |j| {
-            try f.ft_face.loadGlyph(@intCast(j), .{ .render = true, .color = f.ft_face.hasColor() });
-            const ft_glyph = f.ft_face.glyph();
-
-            const position = packing.positions[i];
-            const packing_x: usize = @intCast(position[0]);
-            const packing_y: usize = @intCast(position[1]);
-            const ft_bitmap = ft_glyph.bitmap();
-
-            const h = ft_bitmap.rows();
-            const w = ft_bitmap.width();
-
-            switch (ft_bitmap.pixelMode()) {
-                .gray => {
-                    for (0..h) |y| {
-                        for (0..w) |x| {
-                            const buffer = ft_bitmap.buffer() orelse continue; // Why is it crashing if I take this out of the loop?
-                            const src = y * w + x;
-                            const dst = ((packing_y + y + MARGIN_PX) * packing.size + packing_x + x + MARGIN_PX) * 4;
-
-                            bitmap[dst + 0] = 255;
-                            bitmap[dst + 1] = 255;
-                            bitmap[dst + 2] = 255;
-                            bitmap[dst + 3] = buffer[src];
-                        }
-                    }
-                },
-                .bgra => {
-                    for (0..h) |y| {
-                        for (0..w) |x| {
-                            const buffer = ft_bitmap.buffer() orelse continue;
-                            const src = (y * w + x) * 4;
-                            const dst = ((packing_y + y + MARGIN_PX) * packing.size + packing_x + x + MARGIN_PX) * 4;
-
-                            bitmap[dst + 0] = buffer[src + 2];
-                            bitmap[dst + 1] = buffer[src + 1];
-                            bitmap[dst + 2] = buffer[src + 0];
-                            bitmap[dst + 3] = buffer[src + 3];
-                        }
-                    }
-                },
-                else => unreachable,
-            }
+    return switch (codepoint) {
+        0x231A, 0x231B, 0x23E9...0x23EC, 0x23F0, 0x23F3, 0x25FD, 0x25FE, 0x2614, 0x2615, 0x2648...0x2653, 0x267F,
+        0x2693, 0x26A1, 0x26AA, 0x26AB, 0x26BD, 0x26BE, 0x26C4, 0x26C5, 0x26CE, 0x26D4, 0x26EA, 0x26F2, 0x26F3,
+        0x26F5, 0x26FA, 0x26FD, 0x2705, 0x270A, 0x270B, 0x2728, 0x274C, 0x274E, 0x2753...0x2755, 0x2757,
+        0x2795...0x2797, 0x27B0, 0x27BF, 0x2B1B, 0x2B1C, 0x2B50, 0x2B55, 0x1F004, 0x1F0CF, 0x1F18E, 0x1F191...0x1F19A,
+        0x1F1E6...0x1F1FF, 0x1F201, 0x1F21A, 0x1F22F, 0x1F232...0x1F236, 0x1F238...0x1F23A, 0x1F250, 0x1F251,
+        0x1F300...0x1FAFF,
+        => true,
+        else => false,
+    };
+}
 
-            try f.glyphs.put(@intCast(j), GlyphInfo{
-                .x = packing.positions[i][0],
-                .y = packing.positions[i][1],
-                .width = sizes[i][0],
-                .height = sizes[i][1],
-                .bearing_x = ft_glyph.bitmapLeft() - MARGIN_PX,
-                .bearing_y = ft_glyph.bitmapTop() - MARGIN_PX,
-                .pixel_mode = ft_bitmap.pixelMode(),
-            });
+const Codepoint = struct {
+    value: u21,
+    len: u3, // (in bytes).
+};
 
-            i += 1;
-        }
-    }
-    logTime("Copying bitmaps");
+fn decode(value: []const u8, index: usize) !Codepoint {
+    const len = try std.unicode.utf8ByteSequenceLength(value[index]);
+    if (index + len > value.len) return error.Utf8ExpectedContinuation;
+    return .{ .value = try std.unicode.utf8Decode(value[index..][0..len]), .len = len };
+}
 
-    return .{ .size = packing.size, .bitmap = bitmap };
+/// Number of printable ASCII characters at the start of `bytes`, checked a vector at a time.
+fn printableAsciiLength(bytes: []const u8) usize {
+    const lanes = comptime std.simd.suggestVectorLength(u8) orelse 16;
+    const Chunk = @Vector(lanes, u8);
+    const Mask = std.meta.Int(.unsigned, lanes);
+
+    var i: usize = 0;
+    while (i + lanes <= bytes.len) : (i += lanes) {
+        const chunk: Chunk = bytes[i..][0..lanes].*;
+        // 0x20...0x7E, wrapping everything else above 0x5E.
+        const printable: Mask = @bitCast(chunk -% @as(Chunk, @splat(0x20)) < @as(Chunk, @splat(0x5F)));
+        if (printable != std.math.maxInt(Mask)) return i + @ctz(~printable);
+    }
+    while (i < bytes.len and bytes[i] >= 0x20 and bytes[i] <= 0x7E) i += 1;
+    return i;
 }
 
-/// Split the input string into list of ranges with the same script.
-fn getRanges(allocator: Allocator, value: []const u8) ![]Range {
+/// Split the input string into ranges shaped with one font and script. Each codepoint gets the first font of the
+/// fallback chain that covers it, unless the current range's font covers it too and it doesn't change the script.
+/// Codepoints no font covers stay in the current range (and render as missing glyphs).
+pub fn getRanges(allocator: Allocator, library: *const FontLibrary, value: []const u8) ![]Range {
     var ranges = std.ArrayList(Range).init(allocator);
-    var utf8 = try std.unicode.Utf8View.init(value);
-    var iterator = utf8.iterator();
+    errdefer ranges.deinit();
 
     var current_range: ?Range = null;
-    var byte_index: usize = 0;
+    var index: usize = 0;
+    var next: ?Codepoint = if (value.len > 0) try decode(value, 0) else null;
+
+    while (next) |codepoint| {
+        const end = index + codepoint.len;
+        next = if (end < value.len) try decode(value, end) else null;
 
-    while (iterator.nextCodepointSlice()) |slice| {
-        const codepoint = try std.unicode.utf8Decode(slice);
-        const script = codepointToScript(codepoint);
-        std.debug.print("{X}\n", .{codepoint});
+        const script = codepointToScript(library, codepoint.value);
+        const emoji_presentation = isEmojiPresentation(codepoint.value, if (next) |n| n.value else null);
+        const neutral = isNeutralScript(script);
 
         if (current_range) |*range| {
-            if (range.script == script) {
-                range.end = byte_index + slice.len - 1;
+            // Text and emoji presentation don't share a font, so spaces and digits after emoji use a text font.
+            const covered = library.coverages[range.font].contains(codepoint.value) and
+                emoji_presentation == library.fonts[range.font].ft_face.hasColor();
+            const same_script = neutral or script == range.script or isNeutralScript(range.script);
+            if (extendsCluster(codepoint.value, script) or (covered and same_script)) {
+                if (!neutral and isNeutralScript(range.script)) range.script = script;
+                range.end = end - 1;
             } else {
-                try ranges.append(range.*);
-                current_range = Range{
-                    .script = script,
-                    .start = byte_index,
-                    .end = byte_index + slice.len - 1,
-                };
+                const font = library.fontFor(codepoint.value, emoji_presentation) orelse range.font;
+                if (font == range.font and same_script) {
+                    if (!neutral and isNeutralScript(range.script)) range.script = script;
+                    range.end = end - 1;
+                } else {
+                    try ranges.append(range.*);
+                    current_range = Range{
+                        .script = if (neutral) .common else script,
+                        .font = font,
+                        .start = index,
+                        .end = end - 1,
+                    };
+                }
             }
         } else {
             current_range = Range{
-                .script = script,
-                .start = byte_index,
-                .end = byte_index + slice.len - 1,
+                .script = if (neutral) .common else script,
+                .font = library.fontFor(codepoint.value, emoji_presentation) orelse library.fallback[0],
+                .start = index,
+                .end = end - 1,
             };
         }
-        byte_index += slice.len;
+        index = end;
+
+        // Latin text in the ASCII font: the whole run of printable ASCII continues the range. The last character is
+        // left to the loop above, it could be the base of an emoji sequence.
+        const range = &current_range.?;
+        const ascii = library.ascii_font != null and range.font == library.ascii_font.?;
+        if (ascii and range.script == .latin and next != null and next.?.len == 1) {
+            const count = printableAsciiLength(value[index..]);
+            const skip = if (index + count == value.len) count else count -| 1;
+            if (skip > 0) {
+                index += skip;
+                range.end = index - 1;
+                next = if (index < value.len) try decode(value, index) else null;
+            }
+        }
     }
-    std.debug.print("\n", .{});
 
     if (current_range) |range| {
         try ranges.append(range);
@@ -428,56 +652,76 @@ fn getRanges(allocator: Allocator, value: []const u8) ![]Range {
     return ranges.toOwnedSlice();
 }
 
-/// Segment text into words using ICU4X. Returns a slice of indices where words start or end.
-pub fn segment(allocator: Allocator, value: []const u8) ![]u32 {
-    _ = value; // autofix
-    // const data_provider = icu4x.DataProvider.init();
-    // defer data_provider.deinit();
-
-    // const segmenter = icu4x.WordSegmenter.init(data_provider);
-    // defer segmenter.deinit();
-
-    // var iterator = segmenter.segment(.{ .utf8 = value });
-    // defer iterator.deinit();
-
-    var segments = std.ArrayList(u32).init(allocator);
-    // while (iterator.next()) |s| {
-    //     try segments.append(@intCast(s));
-    // }
-    return segments.toOwnedSlice();
+test "printable ASCII length at vector boundaries" {
+    const lanes = std.simd.suggestVectorLength(u8) orelse 16;
+    // Both ends of the printable range, so that only the byte under test stops the scan.
+    var buffer: [4 * 64 + 3]u8 = undefined;
+    for (&buffer, 0..) |*byte, i| byte.* = if (i % 2 == 0) ' ' else '~';
+    try std.testing.expectEqual(@as(usize, buffer.len), printableAsciiLength(&buffer));
+    try std.testing.expectEqual(@as(usize, 0), printableAsciiLength(""));
+
+    for ([_]usize{ 0, 1, 15, 16, 17, lanes - 1, lanes, lanes + 1, 2 * lanes, buffer.len - 1 }) |position| {
+        for ([_]u8{ 0x1F, 0x7F, 0x80, 0xE6 }) |stop| {
+            const previous = buffer[position];
+            buffer[position] = stop;
+            defer buffer[position] = previous;
+            try std.testing.expectEqual(position, printableAsciiLength(&buffer));
+        }
+    }
 }
 
-/// Wrapper for calling stb_rect_pack.
-fn packAtlas(allocator: Allocator, sizes: [][2]i32, size: comptime_int) ![][2]i32 {
-    const rectangles = try allocator.alloc(stb_rect_pack.c.stbrp_rect, sizes.len);
-    defer allocator.free(rectangles);
-
-    for (sizes, 0..) |s, i| {
-        rectangles[i] = .{
-            .id = @intCast(i),
-            .x = 0,
-            .y = 0,
-            .w = s[0],
-            .h = s[1],
-            .was_packed = 0,
-        };
+test "ranges fall back between fonts and keep emoji sequences together" {
+    const allocator = std.testing.allocator;
+    var library = try FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer library.deinit();
+    const latin_font: u16 = @intFromEnum(FontMapping.Latin);
+    const arabic_font: u16 = @intFromEnum(FontMapping.Arabic);
+    const japanese_font: u16 = @intFromEnum(FontMapping.Japanese);
+    const emoji_font: u16 = @intFromEnum(FontMapping.Emoji);
+
+    // Spaces stay with the text before them, emoji use the color font.
+    const mixed = try getRanges(allocator, &library, "Hi 日本 مرحبا 😀");
+    defer allocator.free(mixed);
+    try std.testing.expectEqualSlices(Range, &.{
+        .{ .script = .latin, .font = latin_font, .start = 0, .end = 2 },
+        .{ .script = .han, .font = japanese_font, .start = 3, .end = 9 },
+        .{ .script = .arabic, .font = arabic_font, .start = 10, .end = 20 },
+        .{ .script = .common, .font = emoji_font, .start = 21, .end = 24 },
+    }, mixed);
+
+    // Keycap (digit, variation selector, keycap mark) and a ZWJ family of four are single ranges.
+    for ([_][]const u8{ "1\u{FE0F}\u{20E3}", "👨\u{200D}👩\u{200D}👧\u{200D}👦" }) |sequence| {
+        const ranges = try getRanges(allocator, &library, sequence);
+        defer allocator.free(ranges);
+        try std.testing.expectEqualSlices(Range, &.{
+            .{ .script = .common, .font = emoji_font, .start = 0, .end = sequence.len - 1 },
+        }, ranges);
     }
 
-    const nodes = try allocator.alloc(stb_rect_pack.c.stbrp_node, size * 2);
-    defer allocator.free(nodes);
-
-    var context: stb_rect_pack.c.stbrp_context = .{};
-    stb_rect_pack.c.stbrp_init_target(@ptrCast(&context), size, size, nodes.ptr, @intCast(nodes.len));
-    const result = stb_rect_pack.c.stbrp_pack_rects(@ptrCast(&context), rectangles.ptr, @intCast(rectangles.len));
-
-    if (result == 0) {
-        return error.FailedToPackAtlas;
-    }
+    // A keycap after ASCII text isn't skipped over with the text.
+    const keycap = try getRanges(allocator, &library, "a 1\u{FE0F}\u{20E3}");
+    defer allocator.free(keycap);
+    try std.testing.expectEqualSlices(Range, &.{
+        .{ .script = .latin, .font = latin_font, .start = 0, .end = 1 },
+        .{ .script = .common, .font = emoji_font, .start = 2, .end = 8 },
+    }, keycap);
+}
 
-    const positions = try allocator.alloc([2]i32, sizes.len);
-    for (rectangles, 0..) |rect, i| {
-        positions[i] = .{ rect.x, rect.y };
+test "ranges end where ASCII text meets another font at vector boundaries" {
+    const allocator = std.testing.allocator;
+    var library = try FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer library.deinit();
+    const lanes = std.simd.suggestVectorLength(u8) orelse 16;
+
+    var buffer: [2 * 64 + 8]u8 = undefined;
+    for ([_]usize{ 1, 15, 16, 17, lanes - 1, lanes, lanes + 1, 2 * lanes }) |position| {
+        @memset(buffer[0..position], 'x');
+        const text = try std.fmt.bufPrint(buffer[position..], "日xy", .{});
+        const ranges = try getRanges(allocator, &library, buffer[0 .. position + text.len]);
+        defer allocator.free(ranges);
+        try std.testing.expectEqual(@as(usize, 3), ranges.len);
+        try std.testing.expectEqual(position - 1, ranges[0].end);
+        try std.testing.expectEqual(position, ranges[1].start);
+        try std.testing.expectEqual(@as(u16, @intFromEnum(FontMapping.Japanese)), ranges[1].font);
     }
-
-    return positions;
 }
@@ -0,0 +1,907 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const ft = @import("mach-freetype");
+const atlas_file = @import("atlas_file.zig");
+
+/// Margin around each glyph in the atlas.
+pub const MARGIN_PX = 1;
+
+/// Distance (in px of the reference size) covered by signed distance fields on each side of the outline.
+pub const SDF_SPREAD = 6;
+
+/// Pixel format of an atlas page. Outline glyphs only need coverage (or distance) so they go to single channel pages, and
+/// only color glyphs (emoji) pay for RGBA.
+pub const Format = enum(u8) {
+    gray, // r8unorm.
+    color, // rgba8unorm.
+
+    pub fn bytesPerPixel(self: Format) u32 {
+        return switch (self) {
+            .gray => 1,
+            .color => 4,
+        };
+    }
+
+    fn fromPixelMode(pixel_mode: ft.PixelMode) Format {
+        return if (pixel_mode == .bgra) .color else .gray;
+    }
+};
+
+/// Identifies a single rasterized glyph. `glyph_id` is a glyph index in the font (not a codepoint) and `size` is the
+/// pixel size it was rendered at.
+pub const GlyphKey = struct {
+    font: u16,
+    glyph_id: u32,
+    size: u16,
+};
+
+pub const GlyphInfo = struct {
+    x: i32, // The x position in the atlas page (in px).
+    y: i32,
+    width: i32, // Width of the glyph in the bitmap (in px).
+    height: i32,
+    bearing_x: i32, // Offset from the left edge of the bitmap to where the glyph starts (in px).
+    bearing_y: i32,
+    format: Format, // Which atlas the glyph lives in.
+    page: u32, // Index of the page (texture array layer) within the atlas.
+    sdf: bool, // Pixels are a signed distance field (128 is the edge) instead of coverage.
+};
+
+/// Rendered glyph as returned by FreeType, ready to be copied into the atlas.
+pub const Bitmap = struct {
+    width: u32,
+    rows: u32,
+    pitch: i32,
+    pixel_mode: ft.PixelMode,
+    buffer: []const u8,
+    left: i32,
+    top: i32,
+    sdf: bool,
+};
+
+pub const Rect = struct {
+    x: u32,
+    y: u32,
+    width: u32,
+    height: u32,
+
+    fn merge(self: Rect, other: Rect) Rect {
+        const x = @min(self.x, other.x);
+        const y = @min(self.y, other.y);
+        return .{
+            .x = x,
+            .y = y,
+            .width = @max(self.x + self.width, other.x + other.width) - x,
+            .height = @max(self.y + self.height, other.y + other.height) - y,
+        };
+    }
+};
+
+/// Skyline bottom-left packer. Keeps the top edge of the packed area as a list of horizontal segments and places each
+/// new rectangle as low as possible.
+const Skyline = struct {
+    const Node = struct { x: u32, y: u32, width: u32 };
+    const Placement = struct { x: u32, y: u32, index: usize };
+
+    width: u32,
+    height: u32,
+    nodes: std.ArrayList(Node),
+
+    fn init(allocator: Allocator, width: u32, height: u32) !Skyline {
+        var nodes = std.ArrayList(Node).init(allocator);
+        try nodes.append(.{ .x = 0, .y = 0, .width = width });
+        return .{ .width = width, .height = height, .nodes = nodes };
+    }
+
+    fn initFromRecords(allocator: Allocator, width: u32, height: u32, records: []const atlas_file.NodeRecord) !Skyline {
+        var nodes = try std.ArrayList(Node).initCapacity(allocator, records.len);
+        for (records) |record| {
+            nodes.appendAssumeCapacity(.{ .x = record.x, .y = record.y, .width = record.width });
+        }
+        return .{ .width = width, .height = height, .nodes = nodes };
+    }
+
+    fn deinit(self: *Skyline) void {
+        self.nodes.deinit();
+    }
+
+    fn reset(self: *Skyline) void {
+        self.nodes.clearRetainingCapacity();
+        self.nodes.appendAssumeCapacity(.{ .x = 0, .y = 0, .width = self.width });
+    }
+
+    /// Find the lowest (and then leftmost) position where `w`×`h` rectangle fits.
+    fn fit(self: *const Skyline, w: u32, h: u32) ?Placement {
+        var best: ?Placement = null;
+        for (self.nodes.items, 0..) |node, i| {
+            if (node.x + w > self.width) break;
+
+            // The rectangle rests on the highest segment it spans.
+            var y: u32 = 0;
+            var covered: u32 = 0;
+            var j = i;
+            while (covered < w) : (j += 1) {
+                y = @max(y, self.nodes.items[j].y);
+                covered += self.nodes.items[j].width;
+            }
+
+            if (y + h > self.height) continue;
+            if (best == null or y < best.?.y) {
+                best = .{ .x = node.x, .y = y, .index = i };
+            }
+        }
+        return best;
+    }
+
+    fn add(self: *Skyline, placement: Placement, w: u32, h: u32) !void {
+        try self.nodes.insert(placement.index, .{ .x = placement.x, .y = placement.y + h, .width = w });
+
+        // Shrink or drop the segments now covered by the new one.
+        const i = placement.index + 1;
+        while (i < self.nodes.items.len) {
+            const end = placement.x + w;
+            const node = &self.nodes.items[i];
+            if (node.x >= end) break;
+
+            const overlap = end - node.x;
+            if (node.width <= overlap) {
+                _ = self.nodes.orderedRemove(i);
+                continue;
+            }
+            node.x += overlap;
+            node.width -= overlap;
+            break;
+        }
+
+        // Merge neighbouring segments of the same height.
+        var k: usize = 0;
+        while (k + 1 < self.nodes.items.len) {
+            if (self.nodes.items[k].y == self.nodes.items[k + 1].y) {
+                self.nodes.items[k].width += self.nodes.items[k + 1].width;
+                _ = self.nodes.orderedRemove(k + 1);
+            } else {
+                k += 1;
+            }
+        }
+    }
+};
+
+const Page = struct {
+    pixels: []u8,
+    owned: bool, // False if pixels point into the cache file mapping.
+    persisted: bool, // Whether glyphs from the cache file still refer to this page.
+    skyline: Skyline,
+    last_used: u64, // Frame in which any glyph from the page was last used.
+    dirty: ?Rect, // Area modified since the last upload.
+};
+
+/// Pages sharing a pixel format. Uploaded to the GPU as one texture array.
+pub const Atlas = struct {
+    format: Format,
+    max_pages: u32,
+    pages: std.ArrayList(Page),
+};
+
+const Entry = struct {
+    info: GlyphInfo,
+    last_used: u64,
+};
+
+/// Glyph atlas filled on demand. Glyphs are rasterized the first time they are requested and packed into fixed size
+/// pages. When all pages of an atlas are full, its least recently used page is cleared and reused.
+///
+/// The cache only manages CPU side memory. Owner is responsible for uploading `dirty` areas of the pages to the GPU.
+///
+/// Content of the cache can be saved to disk with `save()` and restored in the next run with `load()`.
+pub const GlyphCache = struct {
+    allocator: Allocator,
+
+    page_size: u32,
+    atlases: [2]Atlas, // Indexed by `Format`.
+    glyphs: std.AutoHashMap(GlyphKey, Entry),
+
+    mapping: ?atlas_file.Mapping,
+    /// Glyphs loaded from the cache file. They are moved to `glyphs` on first use.
+    persisted: []const atlas_file.GlyphRecord,
+
+    frame: u64,
+    /// Incremented each time a page is evicted. Anything that stores atlas positions should be considered stale after
+    /// it changes.
+    generation: u32,
+    /// Glyphs were added or evicted since the cache was created, loaded or saved. There is nothing new to save if not.
+    modified: bool,
+
+    pub const Options = struct {
+        page_size: u32 = 1024,
+        max_gray_pages: u32 = 8,
+        max_color_pages: u32 = 4,
+    };
+
+    pub fn init(allocator: Allocator, options: Options) GlyphCache {
+        return GlyphCache{
+            .allocator = allocator,
+            .page_size = options.page_size,
+            .atlases = .{
+                .{ .format = .gray, .max_pages = options.max_gray_pages, .pages = std.ArrayList(Page).init(allocator) },
+                .{ .format = .color, .max_pages = options.max_color_pages, .pages = std.ArrayList(Page).init(allocator) },
+            },
+            .glyphs = std.AutoHashMap(GlyphKey, Entry).init(allocator),
+            .mapping = null,
+            .persisted = &.{},
+            .frame = 0,
+            .generation = 0,
+            .modified = false,
+        };
+    }
+
+    pub fn deinit(self: *GlyphCache) void {
+        for (&self.atlases) |*a| {
+            for (a.pages.items) |*p| {
+                if (p.owned) self.allocator.free(p.pixels);
+                p.skyline.deinit();
+            }
+            a.pages.deinit();
+        }
+        self.glyphs.deinit();
+        if (self.mapping) |mapping| mapping.close(self.allocator);
+    }
+
+    pub fn atlas(self: *GlyphCache, format: Format) *Atlas {
+        return &self.atlases[@intFromEnum(format)];
+    }
+
+    fn page(self: *const GlyphCache, format: Format, index: u32) *Page {
+        return &self.atlases[@intFromEnum(format)].pages.items[index];
+    }
+
+    /// Pixels of an atlas page, `page_size` rows of `page_size * format.bytesPerPixel()` bytes.
+    pub fn pagePixels(self: *const GlyphCache, format: Format, index: u32) []const u8 {
+        return self.page(format, index).pixels;
+    }
+
+    /// Marks the start of a new frame. Pages used in the current frame are never evicted.
+    pub fn nextFrame(self: *GlyphCache) void {
+        self.frame += 1;
+    }
+
+    /// Look up a glyph that was already rasterized.
+    pub fn get(self: *GlyphCache, key: GlyphKey) ?GlyphInfo {
+        const entry = self.glyphs.getPtr(key) orelse return self.getPersisted(key);
+        entry.last_used = self.frame;
+        if (entry.info.width != 0) {
+            self.page(entry.info.format, entry.info.page).last_used = self.frame;
+        }
+        return entry.info;
+    }
+
+    /// Keep the page from being evicted in the current frame, for callers that reuse glyph positions without looking
+    /// them up again.
+    pub fn touchPage(self: *GlyphCache, format: Format, index: u32) void {
+        self.page(format, index).last_used = self.frame;
+    }
+
+    fn getPersisted(self: *GlyphCache, key: GlyphKey) ?GlyphInfo {
+        const record = atlas_file.find(self.persisted, key) orelse return null;
+        const info = record.info();
+        if (info.width != 0) {
+            const p = self.page(info.format, info.page);
+            if (!p.persisted) return null; // Page was evicted since loading.
+            p.last_used = self.frame;
+        }
+        self.glyphs.put(key, .{ .info = info, .last_used = self.frame }) catch return null;
+        return info;
+    }
+
+    /// Pack the bitmap into the atlas and remember its position.
+    pub fn insert(self: *GlyphCache, key: GlyphKey, bitmap: Bitmap) !GlyphInfo {
+        const info = try self.reserve(key, bitmap);
+        self.write(info, bitmap);
+        return info;
+    }
+
+    /// Allocate space for the bitmap and register the glyph, without copying pixels. Fill it in with `write()`.
+    pub fn reserve(self: *GlyphCache, key: GlyphKey, bitmap: Bitmap) !GlyphInfo {
+        var info = GlyphInfo{
+            .x = 0,
+            .y = 0,
+            .width = 0,
+            .height = 0,
+            .bearing_x = bitmap.left - MARGIN_PX,
+            .bearing_y = bitmap.top - MARGIN_PX,
+            .format = Format.fromPixelMode(bitmap.pixel_mode),
+            .page = 0,
+            .sdf = bitmap.sdf,
+        };
+
+        // Whitespace has no bitmap and takes no space in the atlas.
+        if (bitmap.width != 0 and bitmap.rows != 0) {
+            const w = bitmap.width + MARGIN_PX * 2;
+            const h = bitmap.rows + MARGIN_PX * 2;
+            const slot = try self.allocate(info.format, w, h);
+            const p = self.page(info.format, slot.page);
+
+            const rect = Rect{ .x = slot.x, .y = slot.y, .width = w, .height = h };
+            p.dirty = if (p.dirty) |dirty| dirty.merge(rect) else rect;
+            p.last_used = self.frame;
+
+            info.x = @intCast(slot.x);
+            info.y = @intCast(slot.y);
+            info.width = @intCast(w);
+            info.height = @intCast(h);
+            info.page = slot.page;
+        }
+
+        try self.glyphs.put(key, .{ .info = info, .last_used = self.frame });
+        self.modified = true;
+        return info;
+    }
+
+    /// Copy glyph pixels into space returned by `reserve()`. Glyphs never overlap, so it is safe to write different
+    /// glyphs from multiple threads at once.
+    pub fn write(self: *const GlyphCache, info: GlyphInfo, bitmap: Bitmap) void {
+        if (info.width == 0) return;
+        const x: u32 = @intCast(info.x + MARGIN_PX);
+        const y: u32 = @intCast(info.y + MARGIN_PX);
+        blit(self.page(info.format, info.page).pixels, self.page_size, x, y, bitmap);
+    }
+
+    fn allocate(self: *GlyphCache, format: Format, w: u32, h: u32) !struct { page: u32, x: u32, y: u32 } {
+        if (w > self.page_size or h > self.page_size) {
+            return error.GlyphTooLarge;
+        }
+
+        const a = self.atlas(format);
+        for (a.pages.items, 0..) |*p, i| {
+            if (p.skyline.fit(w, h)) |placement| {
+                try p.skyline.add(placement, w, h);
+                return .{ .page = @intCast(i), .x = placement.x, .y = placement.y };
+            }
+        }
+
+        const index = if (a.pages.items.len < a.max_pages)
+            try self.addPage(a)
+        else
+            try self.evictPage(a);
+
+        const p = &a.pages.items[index];
+        const placement = p.skyline.fit(w, h) orelse unreachable; // Page is empty.
+        try p.skyline.add(placement, w, h);
+        return .{ .page = index, .x = placement.x, .y = placement.y };
+    }
+
+    fn addPage(self: *GlyphCache, a: *Atlas) !u32 {
+        const pixels = try self.allocator.alloc(u8, self.page_size * self.page_size * a.format.bytesPerPixel());
+        errdefer self.allocator.free(pixels);
+        @memset(pixels, 0);
+
+        var skyline = try Skyline.init(self.allocator, self.page_size, self.page_size);
+        errdefer skyline.deinit();
+
+        try a.pages.append(.{
+            .pixels = pixels,
+            .owned = true,
+            .persisted = false,
+            .skyline = skyline,
+            .last_used = self.frame,
+            .dirty = null,
+        });
+        return @intCast(a.pages.items.len - 1);
+    }
+
+    /// Clear the least recently used page and drop all glyphs that were stored in it.
+    fn evictPage(self: *GlyphCache, a: *Atlas) !u32 {
+        var index: ?u32 = null;
+        for (a.pages.items, 0..) |p, i| {
+            if (p.last_used >= self.frame) continue; // In use by the current frame.
+            if (index == null or p.last_used < a.pages.items[index.?].last_used) {
+                index = @intCast(i);
+            }
+        }
+        const evicted = index orelse return error.AtlasFull;
+
+        var stale = std.ArrayList(GlyphKey).init(self.allocator);
+        defer stale.deinit();
+
+        var iterator = self.glyphs.iterator();
+        while (iterator.next()) |entry| {
+            const info = entry.value_ptr.info;
+            if (info.width != 0 and info.format == a.format and info.page == evicted) {
+                try stale.append(entry.key_ptr.*);
+            }
+        }
+        for (stale.items) |key| {
+            _ = self.glyphs.remove(key);
+        }
+
+        const p = &a.pages.items[evicted];
+        @memset(p.pixels, 0);
+        p.skyline.reset();
+        p.persisted = false;
+        p.dirty = .{ .x = 0, .y = 0, .width = self.page_size, .height = self.page_size };
+        p.last_used = self.frame;
+        self.generation += 1;
+        self.modified = true;
+
+        return evicted;
+    }
+
+    /// Restore pages and glyphs saved by `save()`. Returns false if there is no file or it was created for different
+    /// fonts or settings (as described by `key`). Pixels and glyph records are used in place, without decoding.
+    pub fn load(self: *GlyphCache, path: []const u8, key: u64) !bool {
+        std.debug.assert(self.mapping == null);
+
+        const mapping = atlas_file.Mapping.open(self.allocator, path) catch |err| switch (err) {
+            error.FileNotFound, error.InvalidAtlasFile => return false,
+            else => return err,
+        };
+
+        const header = mapping.header();
+        const page_count = header.page_counts[0] + header.page_counts[1];
+        const pixels_offset = atlas_file.pixelsOffset(page_count, header.node_count, header.glyph_count);
+        var pixels_size: usize = 0;
+        for (self.atlases, header.page_counts) |a, count| {
+            pixels_size += @as(usize, count) * self.page_size * self.page_size * a.format.bytesPerPixel();
+        }
+
+        if (!std.mem.eql(u8, &header.magic, &atlas_file.MAGIC) or
+            header.version != atlas_file.VERSION or
+            header.key != key or
+            header.page_size != self.page_size or
+            header.page_counts[0] > self.atlases[0].max_pages or
+            header.page_counts[1] > self.atlases[1].max_pages or
+            header.pixels_offset != pixels_offset or
+            mapping.bytes.len != pixels_offset + pixels_size)
+        {
+            mapping.close(self.allocator);
+            return false;
+        }
+
+        const page_records = mapping.slice(atlas_file.PageRecord, atlas_file.pagesOffset(), page_count);
+        const nodes = mapping.slice(atlas_file.NodeRecord, atlas_file.nodesOffset(page_count), header.node_count);
+        const records = mapping.slice(
+            atlas_file.GlyphRecord,
+            atlas_file.glyphsOffset(page_count, header.node_count),
+            header.glyph_count,
+        );
+
+        // Anything that would be used as an index is checked, a damaged file is rebuilt instead of read out of bounds.
+        for (page_records) |record| {
+            if (record.node_count == 0 or @as(u64, record.node_start) + record.node_count > nodes.len or
+                !atlas_file.isValidSkyline(nodes[record.node_start..][0..record.node_count], self.page_size))
+            {
+                mapping.close(self.allocator);
+                return false;
+            }
+        }
+        for (records) |record| {
+            if (!record.isValid(self.page_size, header.page_counts)) {
+                mapping.close(self.allocator);
+                return false;
+            }
+        }
+        self.mapping = mapping;
+
+        // Pages are stored atlas by atlas, gray first.
+        var record_index: usize = 0;
+        var offset = pixels_offset;
+        for (&self.atlases, header.page_counts) |*a, count| {
+            const page_bytes = @as(usize, self.page_size) * self.page_size * a.format.bytesPerPixel();
+            try a.pages.ensureTotalCapacity(count);
+            for (page_records[record_index..][0..count]) |record| {
+                const skyline = try Skyline.initFromRecords(
+                    self.allocator,
+                    self.page_size,
+                    self.page_size,
+                    nodes[record.node_start..][0..record.node_count],
+                );
+                a.pages.appendAssumeCapacity(.{
+                    .pixels = mapping.bytes[offset..][0..page_bytes],
+                    .owned = false,
+                    .persisted = true,
+                    .skyline = skyline,
+                    .last_used = self.frame,
+                    .dirty = .{ .x = 0, .y = 0, .width = self.page_size, .height = self.page_size },
+                });
+                offset += page_bytes;
+            }
+            record_index += count;
+        }
+
+        self.persisted = records;
+        self.modified = false;
+        return true;
+    }
+
+    /// Write all pages and glyphs to `path`. The file is replaced atomically.
+    pub fn save(self: *GlyphCache, path: []const u8, key: u64) !void {
+        var records = std.ArrayList(atlas_file.GlyphRecord).init(self.allocator);
+        defer records.deinit();
+
+        var iterator = self.glyphs.iterator();
+        while (iterator.next()) |entry| {
+            try records.append(atlas_file.GlyphRecord.init(entry.key_ptr.*, entry.value_ptr.info));
+        }
+        // Glyphs loaded from the previous file that were not used in this run.
+        for (self.persisted) |record| {
+            if (self.glyphs.contains(record.key())) continue;
+            const info = record.info();
+            if (info.width != 0 and !self.page(info.format, info.page).persisted) continue;
+            try records.append(record);
+        }
+        std.mem.sort(atlas_file.GlyphRecord, records.items, {}, atlas_file.GlyphRecord.lessThan);
+
+        var page_records = std.ArrayList(atlas_file.PageRecord).init(self.allocator);
+        defer page_records.deinit();
+        var nodes = std.ArrayList(atlas_file.NodeRecord).init(self.allocator);
+        defer nodes.deinit();
+
+        for (self.atlases) |a| {
+            for (a.pages.items) |p| {
+                try page_records.append(.{
+                    .node_start = @intCast(nodes.items.len),
+                    .node_count = @intCast(p.skyline.nodes.items.len),
+                });
+                for (p.skyline.nodes.items) |node| {
+                    try nodes.append(.{ .x = node.x, .y = node.y, .width = node.width });
+                }
+            }
+        }
+
+        const page_count = page_records.items.len;
+        const pixels_offset = atlas_file.pixelsOffset(page_count, nodes.items.len, records.items.len);
+        const header = atlas_file.Header{
+            .magic = atlas_file.MAGIC,
+            .version = atlas_file.VERSION,
+            .key = key,
+            .page_size = self.page_size,
+            .page_counts = .{
+                @intCast(self.atlases[0].pages.items.len),
+                @intCast(self.atlases[1].pages.items.len),
+            },
+            .node_count = @intCast(nodes.items.len),
+            .glyph_count = @intCast(records.items.len),
+            .pixels_offset = pixels_offset,
+        };
+
+        const tmp_path = try std.fmt.allocPrint(self.allocator, "{s}.tmp", .{path});
+        defer self.allocator.free(tmp_path);
+
+        {
+            const file = try std.fs.cwd().createFile(tmp_path, .{});
+            defer file.close();
+
+            var buffered = std.io.bufferedWriter(file.writer());
+            const writer = buffered.writer();
+            try writer.writeStruct(header);
+            try writer.writeAll(std.mem.sliceAsBytes(page_records.items));
+            try writer.writeAll(std.mem.sliceAsBytes(nodes.items));
+            try writer.writeAll(std.mem.sliceAsBytes(records.items));
+            try writer.writeByteNTimes(0, pixels_offset - atlas_file.glyphsOffset(page_count, nodes.items.len) -
+                records.items.len * @sizeOf(atlas_file.GlyphRecord));
+            for (self.atlases) |a| {
+                for (a.pages.items) |p| {
+                    try writer.writeAll(p.pixels);
+                }
+            }
+            try buffered.flush();
+        }
+
+        try std.fs.cwd().rename(tmp_path, path);
+        self.modified = false;
+    }
+};
+
+/// Copy glyph bitmap into the page at (x, y). Gray bitmaps are copied row by row, BGRA ones are swizzled to RGBA.
+fn blit(pixels: []u8, page_size: u32, x: u32, y: u32, bitmap: Bitmap) void {
+    const pitch: usize = @abs(bitmap.pitch);
+    switch (bitmap.pixel_mode) {
+        .gray => {
+            for (0..bitmap.rows) |row| {
+                const src = bitmap.buffer[row * pitch ..][0..bitmap.width];
+                const dst = pixels[(y + row) * page_size + x ..][0..bitmap.width];
+                @memcpy(dst, src);
+            }
+        },
+        .bgra => {
+            for (0..bitmap.rows) |row| {
+                const src = bitmap.buffer[row * pitch ..][0 .. bitmap.width * 4];
+                const dst = pixels[((y + row) * page_size + x) * 4 ..][0 .. bitmap.width * 4];
+                swizzleRow(dst, src);
+            }
+        },
+        else => unreachable,
+    }
+}
+
+/// Convert a row of BGRA pixels to RGBA, four pixels at a time.
+fn swizzleRow(dst: []u8, src: []const u8) void {
+    const mask = @Vector(16, i32){ 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 };
+
+    var i: usize = 0;
+    while (i + 16 <= src.len) : (i += 16) {
+        const bgra: @Vector(16, u8) = src[i..][0..16].*;
+        dst[i..][0..16].* = @shuffle(u8, bgra, undefined, mask);
+    }
+    while (i < src.len) : (i += 4) {
+        dst[i + 0] = src[i + 2];
+        dst[i + 1] = src[i + 1];
+        dst[i + 2] = src[i + 0];
+        dst[i + 3] = src[i + 3];
+    }
+}
+
+fn expectNodes(skyline: *const Skyline, expected: []const Skyline.Node) !void {
+    try std.testing.expectEqualSlices(Skyline.Node, expected, skyline.nodes.items);
+}
+
+test "skyline places rectangles as low as possible and merges segments" {
+    var skyline = try Skyline.init(std.testing.allocator, 16, 16);
+    defer skyline.deinit();
+
+    const first = skyline.fit(4, 4).?;
+    try std.testing.expectEqual(Skyline.Placement{ .x = 0, .y = 0, .index = 0 }, first);
+    try skyline.add(first, 4, 4);
+    try expectNodes(&skyline, &.{ .{ .x = 0, .y = 4, .width = 4 }, .{ .x = 4, .y = 0, .width = 12 } });
+
+    const second = skyline.fit(4, 2).?;
+    try std.testing.expectEqual(Skyline.Placement{ .x = 4, .y = 0, .index = 1 }, second);
+    try skyline.add(second, 4, 2);
+    try expectNodes(&skyline, &.{
+        .{ .x = 0, .y = 4, .width = 4 },
+        .{ .x = 4, .y = 2, .width = 4 },
+        .{ .x = 8, .y = 0, .width = 8 },
+    });
+
+    // Covers the last segment and ends up at the height of the one before, so the two merge.
+    const third = skyline.fit(8, 2).?;
+    try std.testing.expectEqual(Skyline.Placement{ .x = 8, .y = 0, .index = 2 }, third);
+    try skyline.add(third, 8, 2);
+    try expectNodes(&skyline, &.{ .{ .x = 0, .y = 4, .width = 4 }, .{ .x = 4, .y = 2, .width = 12 } });
+
+    // A rectangle spanning segments rests on the highest of them.
+    try std.testing.expectEqual(Skyline.Placement{ .x = 0, .y = 4, .index = 0 }, skyline.fit(16, 12).?);
+    try std.testing.expect(skyline.fit(16, 13) == null);
+    try std.testing.expect(skyline.fit(17, 1) == null);
+
+    skyline.reset();
+    try expectNodes(&skyline, &.{.{ .x = 0, .y = 0, .width = 16 }});
+}
+
+/// Gray bitmap of `size`×`size` pixels of `value`, which takes `size + 2 * MARGIN_PX` px in the atlas.
+fn testBitmap(pixels: []u8, size: u32, value: u8) Bitmap {
+    @memset(pixels[0 .. size * size], value);
+    return .{
+        .width = size,
+        .rows = size,
+        .pitch = @intCast(size),
+        .pixel_mode = .gray,
+        .buffer = pixels[0 .. size * size],
+        .left = 0,
+        .top = @intCast(size),
+        .sdf = false,
+    };
+}
+
+fn testKey(glyph_id: u32) GlyphKey {
+    return .{ .font = 0, .glyph_id = glyph_id, .size = 16 };
+}
+
+test "glyphs are packed into pages and copied inside their margin" {
+    var cache = GlyphCache.init(std.testing.allocator, .{ .page_size = 16, .max_gray_pages = 2 });
+    defer cache.deinit();
+    var pixels: [256]u8 = undefined;
+
+    const a = try cache.insert(testKey(1), testBitmap(&pixels, 6, 0xAA));
+    const b = try cache.insert(testKey(2), testBitmap(&pixels, 6, 0xBB));
+    try std.testing.expectEqual(@as(u32, 0), a.page);
+    try std.testing.expectEqual(@as(u32, 0), b.page);
+    try std.testing.expectEqual(@as(i32, 8), a.width);
+    try std.testing.expectEqual(@as(i32, 8), b.x);
+    try std.testing.expectEqual(@as(i32, 6 - MARGIN_PX), a.bearing_y);
+
+    // Margins stay empty, the bitmap starts one pixel in.
+    const page = cache.pagePixels(.gray, 0);
+    try std.testing.expectEqual(@as(u8, 0), page[0]);
+    try std.testing.expectEqual(@as(u8, 0xAA), page[1 * 16 + 1]);
+    try std.testing.expectEqual(@as(u8, 0xAA), page[6 * 16 + 6]);
+    try std.testing.expectEqual(@as(u8, 0), page[7 * 16 + 7]);
+    try std.testing.expectEqual(@as(u8, 0xBB), page[1 * 16 + 9]);
+    const dirty = cache.atlas(.gray).pages.items[0].dirty.?;
+    try std.testing.expectEqual(Rect{ .x = 0, .y = 0, .width = 16, .height = 8 }, dirty);
+
+    try std.testing.expectEqual(a, cache.get(testKey(1)).?);
+    try std.testing.expect(cache.get(testKey(3)) == null);
+    try std.testing.expectError(error.GlyphTooLarge, cache.insert(testKey(3), testBitmap(&pixels, 15, 0xCC)));
+}
+
+test "glyphs without pixels take no space" {
+    var cache = GlyphCache.init(std.testing.allocator, .{ .page_size = 16 });
+    defer cache.deinit();
+    var pixels: [1]u8 = undefined;
+
+    const space = try cache.reserve(testKey(1), testBitmap(&pixels, 0, 0));
+    try std.testing.expectEqual(@as(i32, 0), space.width);
+    try std.testing.expectEqual(@as(i32, 0), space.height);
+    try std.testing.expectEqual(@as(usize, 0), cache.atlas(.gray).pages.items.len);
+    try std.testing.expectEqual(space, cache.get(testKey(1)).?);
+}
+
+test "least recently used page is evicted, pages of the current frame are not" {
+    var cache = GlyphCache.init(std.testing.allocator, .{ .page_size = 16, .max_gray_pages = 2 });
+    defer cache.deinit();
+    // Each glyph fills a whole page.
+    var pixels: [256]u8 = undefined;
+
+    _ = try cache.insert(testKey(1), testBitmap(&pixels, 14, 0x11));
+    cache.nextFrame();
+    _ = try cache.insert(testKey(2), testBitmap(&pixels, 14, 0x22));
+    try std.testing.expectEqual(@as(usize, 2), cache.atlas(.gray).pages.items.len);
+    cache.nextFrame();
+    _ = cache.get(testKey(1)).?;
+    cache.nextFrame();
+
+    // Page 1 was used less recently than page 0.
+    const third = try cache.insert(testKey(3), testBitmap(&pixels, 14, 0x33));
+    try std.testing.expectEqual(@as(u32, 1), third.page);
+    try std.testing.expectEqual(@as(u32, 1), cache.generation);
+    try std.testing.expect(cache.get(testKey(2)) == null);
+    try std.testing.expect(cache.get(testKey(1)) != null);
+    try std.testing.expectEqual(@as(u8, 0x33), cache.pagePixels(.gray, 1)[1 * 16 + 1]);
+    const dirty = cache.atlas(.gray).pages.items[1].dirty.?;
+    try std.testing.expectEqual(Rect{ .x = 0, .y = 0, .width = 16, .height = 16 }, dirty);
+
+    // Both pages are in use by this frame now.
+    try std.testing.expectError(error.AtlasFull, cache.insert(testKey(4), testBitmap(&pixels, 14, 0x44)));
+    try std.testing.expectEqual(@as(u32, 1), cache.generation);
+    try std.testing.expect(cache.get(testKey(4)) == null);
+    try std.testing.expectEqual(@as(u8, 0x11), cache.pagePixels(.gray, 0)[1 * 16 + 1]);
+
+    // A page whose glyphs weren't looked up can be evicted again in the next frame, unless it is touched.
+    cache.nextFrame();
+    cache.touchPage(.gray, 1);
+    const fourth = try cache.insert(testKey(4), testBitmap(&pixels, 14, 0x44));
+    try std.testing.expectEqual(@as(u32, 0), fourth.page);
+    try std.testing.expectEqual(@as(u32, 2), cache.generation);
+    try std.testing.expect(cache.get(testKey(1)) == null);
+    try std.testing.expect(cache.get(testKey(3)) != null);
+}
+
+const TEST_ATLAS_KEY = 42;
+
+/// Path of a cache file in the temporary directory, relative paths would be resolved against the working directory.
+fn testCachePath(allocator: Allocator, tmp: *std.testing.TmpDir) ![]u8 {
+    const dir = try tmp.dir.realpathAlloc(allocator, ".");
+    defer allocator.free(dir);
+    return std.fs.path.join(allocator, &.{ dir, "font_atlas.cache" });
+}
+
+/// Cache with a glyph on each of two gray pages and an empty one, saved to `path`.
+fn saveTestCache(allocator: Allocator, path: []const u8, options: GlyphCache.Options) !GlyphCache {
+    var cache = GlyphCache.init(allocator, options);
+    errdefer cache.deinit();
+    var pixels: [256]u8 = undefined;
+    _ = try cache.insert(testKey(1), testBitmap(&pixels, 6, 0xAA));
+    _ = try cache.insert(testKey(2), testBitmap(&pixels, 14, 0xBB));
+    _ = try cache.insert(testKey(3), testBitmap(&pixels, 0, 0));
+    try cache.save(path, TEST_ATLAS_KEY);
+    return cache;
+}
+
+test "atlas is restored from the cache file" {
+    const allocator = std.testing.allocator;
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try testCachePath(allocator, &tmp);
+    defer allocator.free(path);
+
+    const options = GlyphCache.Options{ .page_size = 16, .max_gray_pages = 2 };
+    var saved = try saveTestCache(allocator, path, options);
+    defer saved.deinit();
+
+    var loaded = GlyphCache.init(allocator, options);
+    defer loaded.deinit();
+    try std.testing.expect(try loaded.load(path, TEST_ATLAS_KEY));
+    try std.testing.expectEqual(@as(usize, 2), loaded.atlas(.gray).pages.items.len);
+    try std.testing.expectEqual(@as(usize, 0), loaded.atlas(.color).pages.items.len);
+    for (saved.atlas(.gray).pages.items, loaded.atlas(.gray).pages.items) |expected, actual| {
+        try std.testing.expectEqualSlices(u8, expected.pixels, actual.pixels);
+        try std.testing.expectEqualSlices(Skyline.Node, expected.skyline.nodes.items, actual.skyline.nodes.items);
+        try std.testing.expect(actual.persisted and !actual.owned);
+    }
+
+    // Glyphs are looked up in the file and moved to the hash map on first use.
+    try std.testing.expectEqual(@as(usize, 3), loaded.persisted.len);
+    try std.testing.expectEqual(@as(u32, 0), loaded.glyphs.count());
+    for (1..4) |glyph_id| {
+        const key = testKey(@intCast(glyph_id));
+        try std.testing.expectEqual(saved.get(key).?, atlas_file.find(loaded.persisted, key).?.info());
+        try std.testing.expectEqual(saved.get(key).?, loaded.get(key).?);
+    }
+    try std.testing.expectEqual(@as(u32, 3), loaded.glyphs.count());
+    try std.testing.expect(loaded.get(testKey(4)) == null);
+
+    // Only new glyphs need saving, not the ones that came from the file.
+    try std.testing.expect(!saved.modified and !loaded.modified);
+    var pixels: [16]u8 = undefined;
+    _ = try loaded.insert(testKey(4), testBitmap(&pixels, 4, 0xCC));
+    try std.testing.expect(loaded.modified);
+}
+
+test "cache file of different fonts or settings is ignored" {
+    const allocator = std.testing.allocator;
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try testCachePath(allocator, &tmp);
+    defer allocator.free(path);
+
+    const options = GlyphCache.Options{ .page_size = 16, .max_gray_pages = 2 };
+    var saved = try saveTestCache(allocator, path, options);
+    saved.deinit();
+
+    const Case = struct { key: u64, options: GlyphCache.Options };
+    for ([_]Case{
+        .{ .key = TEST_ATLAS_KEY + 1, .options = options },
+        .{ .key = TEST_ATLAS_KEY, .options = .{ .page_size = 32, .max_gray_pages = 2 } },
+        .{ .key = TEST_ATLAS_KEY, .options = .{ .page_size = 16, .max_gray_pages = 1 } },
+    }) |case| {
+        var cache = GlyphCache.init(allocator, case.options);
+        defer cache.deinit();
+        try std.testing.expect(!try cache.load(path, case.key));
+        try std.testing.expect(cache.mapping == null);
+        try std.testing.expectEqual(@as(usize, 0), cache.atlas(.gray).pages.items.len);
+    }
+
+    var missing = GlyphCache.init(allocator, options);
+    defer missing.deinit();
+    const missing_path = try std.fs.path.join(allocator, &.{ std.fs.path.dirname(path).?, "missing.cache" });
+    defer allocator.free(missing_path);
+    try std.testing.expect(!try missing.load(missing_path, TEST_ATLAS_KEY));
+}
+
+test "damaged cache file is ignored" {
+    const allocator = std.testing.allocator;
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try testCachePath(allocator, &tmp);
+    defer allocator.free(path);
+
+    const options = GlyphCache.Options{ .page_size = 16, .max_gray_pages = 2 };
+    var saved = try saveTestCache(allocator, path, options);
+    saved.deinit();
+    const bytes = try std.fs.cwd().readFileAlloc(allocator, path, 1 << 20);
+    defer allocator.free(bytes);
+
+    // Records of the file: two pages, the first with nodes [0, 8) at 8 and [8, 16) at 0. The first glyph (key 1) is
+    // 8×8 at (0, 0) of page 0.
+    const header = std.mem.bytesToValue(atlas_file.Header, bytes[0..@sizeOf(atlas_file.Header)]);
+    const nodes = atlas_file.nodesOffset(2);
+    const glyphs = atlas_file.glyphsOffset(2, header.node_count);
+    const Damage = struct { offset: usize, value: u32 };
+    for ([_]Damage{
+        .{ .offset = @offsetOf(atlas_file.Header, "version"), .value = atlas_file.VERSION + 1 },
+        .{ .offset = @offsetOf(atlas_file.Header, "page_counts"), .value = 1 }, // File size doesn't match.
+        .{ .offset = atlas_file.pagesOffset() + @offsetOf(atlas_file.PageRecord, "node_count"), .value = 0 },
+        .{ .offset = atlas_file.pagesOffset() + @offsetOf(atlas_file.PageRecord, "node_start"), .value = 1000 },
+        .{ .offset = nodes + @offsetOf(atlas_file.NodeRecord, "width"), .value = 0 },
+        .{ .offset = nodes + @offsetOf(atlas_file.NodeRecord, "y"), .value = 17 },
+        .{ .offset = glyphs + @offsetOf(atlas_file.GlyphRecord, "page"), .value = 2 },
+        .{ .offset = glyphs + @offsetOf(atlas_file.GlyphRecord, "x"), .value = 12 },
+        .{ .offset = glyphs + @offsetOf(atlas_file.GlyphRecord, "format"), .value = 7 },
+    }) |damage| {
+        const copy = try allocator.dupe(u8, bytes);
+        defer allocator.free(copy);
+        std.mem.bytesAsValue(u32, copy[damage.offset..][0..4]).* = damage.value;
+        try std.fs.cwd().writeFile(.{ .sub_path = path, .data = copy });
+
+        var cache = GlyphCache.init(allocator, options);
+        defer cache.deinit();
+        try std.testing.expect(!try cache.load(path, TEST_ATLAS_KEY));
+        try std.testing.expectEqual(@as(usize, 0), cache.atlas(.gray).pages.items.len);
+    }
+
+    // Too short for a header.
+    try std.fs.cwd().writeFile(.{ .sub_path = path, .data = bytes[0..8] });
+    var cache = GlyphCache.init(allocator, options);
+    defer cache.deinit();
+    try std.testing.expect(!try cache.load(path, TEST_ATLAS_KEY));
+}
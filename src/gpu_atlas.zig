@@ -0,0 +1,67 @@
+const zgpu = @import("zgpu");
+const glyph_cache = @import("glyph_cache.zig");
+const GlyphCache = glyph_cache.GlyphCache;
+
+/// GPU copy of the glyph cache: a texture array per `glyph_cache.Format`, one layer per atlas page.
+pub const GpuAtlas = struct {
+    gctx: *zgpu.GraphicsContext,
+    textures: [2]zgpu.TextureHandle,
+    size: u32, // Width and height of a page (in px).
+
+    /// Create the textures and upload pages that are already in the cache (for example restored from the cache file).
+    pub fn init(gctx: *zgpu.GraphicsContext, cache: *GlyphCache) GpuAtlas {
+        var textures: [2]zgpu.TextureHandle = undefined;
+        for (&textures, cache.atlases) |*handle, atlas| {
+            handle.* = gctx.createTexture(.{
+                .usage = .{ .texture_binding = true, .copy_dst = true },
+                .size = .{
+                    .width = cache.page_size,
+                    .height = cache.page_size,
+                    .depth_or_array_layers = atlas.max_pages,
+                },
+                .format = zgpu.imageInfoToTextureFormat(atlas.format.bytesPerPixel(), 1, false),
+            });
+        }
+
+        var gpu_atlas = GpuAtlas{ .gctx = gctx, .textures = textures, .size = cache.page_size };
+        gpu_atlas.flush(cache);
+        return gpu_atlas;
+    }
+
+    pub fn deinit(self: *GpuAtlas) void {
+        for (self.textures) |handle| {
+            self.gctx.releaseResource(handle);
+        }
+    }
+
+    pub fn texture(self: *const GpuAtlas, format: glyph_cache.Format) zgpu.TextureHandle {
+        return self.textures[@intFromEnum(format)];
+    }
+
+    /// Upload parts of the atlas that changed since the last call.
+    pub fn flush(self: *GpuAtlas, cache: *GlyphCache) void {
+        const size = cache.page_size;
+
+        for (&cache.atlases, self.textures) |*atlas, handle| {
+            const gpu_texture = self.gctx.lookupResource(handle) orelse continue;
+            const bytes_per_pixel = atlas.format.bytesPerPixel();
+
+            for (atlas.pages.items, 0..) |*page, i| {
+                const rect = page.dirty orelse continue;
+                page.dirty = null;
+
+                self.gctx.queue.writeTexture(
+                    .{ .texture = gpu_texture, .origin = .{ .x = rect.x, .y = rect.y, .z = @intCast(i) } },
+                    .{
+                        .offset = (rect.y * size + rect.x) * bytes_per_pixel,
+                        .bytes_per_row = size * bytes_per_pixel,
+                        .rows_per_image = rect.height,
+                    },
+                    .{ .width = rect.width, .height = rect.height },
+                    u8,
+                    page.pixels,
+                );
+            }
+        }
+    }
+};
@@ -0,0 +1,809 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const font = @import("font.zig");
+const bidi = @import("bidi.zig");
+const line_break = @import("line_break.zig");
+const FontLibrary = font.FontLibrary;
+const GlyphShape = font.GlyphShape;
+const GlyphKey = @import("glyph_cache.zig").GlyphKey;
+
+/// How words are distributed between lines of a paragraph.
+pub const Fitting = enum {
+    /// Put as many words on each line as fit. Fast and stable while typing at the end of a paragraph.
+    greedy,
+    /// Minimize the sum of squared free space at the end of each line except the last (Knuth–Plass without
+    /// hyphenation), which gives a more even right edge.
+    optimal,
+};
+
+/// Glyph of a shaped piece, relative to the start of the piece. Glyphs are rasterized when their line is drawn, so
+/// text that is never visible doesn't take space in the atlas and glyphs evicted in the meantime are rendered again.
+const Glyph = font.GlyphPosition;
+
+/// Part of a word with a single bidi level, shaped as one unit.
+const Piece = struct {
+    glyph_start: u32, // In `Paragraph.glyphs`.
+    glyph_count: u32,
+    advance: i32, // (in px).
+    level: u8,
+};
+
+/// Text between two line break opportunities. Lines only break between words.
+const Word = struct {
+    piece_start: u32, // In `Paragraph.pieces`.
+    piece_count: u32,
+    width: i32, // Advance of the pieces (in px).
+    space: i32, // Advance of trailing whitespace, which hangs past the end of the line when the line breaks after it.
+};
+
+const Line = struct {
+    word_start: u32, // In `Paragraph.words`.
+    word_count: u32,
+    width: i32, // Without trailing whitespace (in px).
+};
+
+/// Text between mandatory line breaks. Words are shaped once, fitting them into lines is redone when the width changes.
+const Paragraph = struct {
+    text: []u8, // Without the line break.
+    level: u8, // Base bidi level, odd for right-to-left paragraphs.
+    glyphs: std.ArrayList(Glyph),
+    pieces: std.ArrayList(Piece),
+    words: std.ArrayList(Word),
+    lines: std.ArrayList(Line),
+    shaped: bool,
+    fitted: bool,
+    first_line: usize, // Index of the first line in the layout.
+
+    fn create(allocator: Allocator, text: []const u8) !*Paragraph {
+        const paragraph = try allocator.create(Paragraph);
+        errdefer allocator.destroy(paragraph);
+        paragraph.* = .{
+            .text = try allocator.dupe(u8, text),
+            .level = 0,
+            .glyphs = std.ArrayList(Glyph).init(allocator),
+            .pieces = std.ArrayList(Piece).init(allocator),
+            .words = std.ArrayList(Word).init(allocator),
+            .lines = std.ArrayList(Line).init(allocator),
+            .shaped = false,
+            .fitted = false,
+            .first_line = 0,
+        };
+        return paragraph;
+    }
+
+    fn destroy(self: *Paragraph, allocator: Allocator) void {
+        allocator.free(self.text);
+        self.glyphs.deinit();
+        self.pieces.deinit();
+        self.words.deinit();
+        self.lines.deinit();
+        allocator.destroy(self);
+    }
+};
+
+/// Piece placed on a line, in visual order.
+const Placement = struct {
+    piece: u32,
+    space: i32, // Whitespace after the piece in logical order.
+    level: u8,
+};
+
+/// Retained layout of multiple paragraphs of text: line breaking (UAX #14), fitting lines to `max_width` and
+/// reordering right-to-left runs (UAX #9).
+///
+/// Layout is incremental. Changing the text only reshapes the paragraphs that differ, changing the width only fits the
+/// already shaped words into lines again. Changes are applied by `update()`.
+///
+/// All positions and widths are in px.
+pub const Layout = struct {
+    allocator: Allocator,
+    library: *FontLibrary,
+
+    size: u16, // Text size (in logical px).
+    max_width: i32,
+    fitting: Fitting,
+    line_height: i32,
+    baseline: i32, // Distance from the top of a line to the baseline.
+
+    paragraphs: std.ArrayList(*Paragraph),
+    dirty_start: usize, // Range of paragraphs that need shaping or fitting.
+    dirty_end: usize,
+    positioned: usize, // Paragraphs before this index have valid `first_line`.
+    line_count: usize,
+
+    /// Incremented on every change, so that users of the layout can tell whether their copy of it is stale.
+    version: u64,
+
+    // Scratch space.
+    keys: std.ArrayList(GlyphKey),
+    levels: std.ArrayList(u8),
+    widths: std.ArrayList(i64),
+    costs: std.ArrayList(f64),
+    previous: std.ArrayList(u32),
+    placements: std.ArrayList(Placement),
+
+    pub const Options = struct {
+        size: u16 = font.font_size,
+        /// Lines longer than this are wrapped. Words longer than a line overflow it.
+        max_width: i32 = std.math.maxInt(i32),
+        fitting: Fitting = .greedy,
+        /// Line height relative to the text size.
+        line_spacing: f32 = 1.4,
+    };
+
+    pub fn init(allocator: Allocator, library: *FontLibrary, options: Options) Layout {
+        const pixel_size: i32 = @intCast(options.size * library.dpr);
+        const line_height: i32 = @intFromFloat(@round(@as(f32, @floatFromInt(pixel_size)) * options.line_spacing));
+        return .{
+            .allocator = allocator,
+            .library = library,
+            .size = options.size,
+            .max_width = options.max_width,
+            .fitting = options.fitting,
+            .line_height = line_height,
+            // Center the em box in the line, with the baseline at 80% of its height.
+            .baseline = @divTrunc(line_height - pixel_size, 2) + @divTrunc(pixel_size * 4, 5),
+            .paragraphs = std.ArrayList(*Paragraph).init(allocator),
+            .dirty_start = 0,
+            .dirty_end = 0,
+            .positioned = 0,
+            .line_count = 0,
+            .version = 0,
+            .keys = std.ArrayList(GlyphKey).init(allocator),
+            .levels = std.ArrayList(u8).init(allocator),
+            .widths = std.ArrayList(i64).init(allocator),
+            .costs = std.ArrayList(f64).init(allocator),
+            .previous = std.ArrayList(u32).init(allocator),
+            .placements = std.ArrayList(Placement).init(allocator),
+        };
+    }
+
+    pub fn deinit(self: *Layout) void {
+        for (self.paragraphs.items) |paragraph| {
+            paragraph.destroy(self.allocator);
+        }
+        self.paragraphs.deinit();
+        self.keys.deinit();
+        self.levels.deinit();
+        self.widths.deinit();
+        self.costs.deinit();
+        self.previous.deinit();
+        self.placements.deinit();
+    }
+
+    /// Replace the whole text. Paragraphs at the start and end that didn't change keep their shaping and lines, so
+    /// editing a long text this way only reshapes the edited paragraphs.
+    pub fn setText(self: *Layout, text: []const u8) !void {
+        var texts = std.ArrayList([]const u8).init(self.allocator);
+        defer texts.deinit();
+        try splitParagraphs(text, &texts);
+
+        const old = self.paragraphs.items;
+        var prefix: usize = 0;
+        while (prefix < @min(old.len, texts.items.len) and
+            std.mem.eql(u8, old[prefix].text, texts.items[prefix])) prefix += 1;
+        var suffix: usize = 0;
+        while (suffix < @min(old.len, texts.items.len) - prefix and
+            std.mem.eql(u8, old[old.len - 1 - suffix].text, texts.items[texts.items.len - 1 - suffix])) suffix += 1;
+
+        if (prefix == old.len and prefix == texts.items.len) return;
+        try self.replace(prefix, old.len - prefix - suffix, texts.items[prefix .. texts.items.len - suffix]);
+    }
+
+    /// Replace `count` paragraphs starting at `index` with paragraphs of `text`. Other paragraphs are not touched.
+    pub fn replaceParagraphs(self: *Layout, index: usize, count: usize, text: []const u8) !void {
+        var texts = std.ArrayList([]const u8).init(self.allocator);
+        defer texts.deinit();
+        try splitParagraphs(text, &texts);
+        try self.replace(index, count, texts.items);
+    }
+
+    pub fn removeParagraphs(self: *Layout, index: usize, count: usize) !void {
+        try self.replace(index, count, &.{});
+    }
+
+    pub fn paragraphCount(self: *const Layout) usize {
+        return self.paragraphs.items.len;
+    }
+
+    /// Text of a paragraph, without the line break.
+    pub fn paragraphText(self: *const Layout, index: usize) []const u8 {
+        return self.paragraphs.items[index].text;
+    }
+
+    /// Change the width lines are fitted to. Words are not shaped again.
+    pub fn setMaxWidth(self: *Layout, max_width: i32) void {
+        if (max_width == self.max_width) return;
+        self.max_width = max_width;
+        self.refitAll();
+    }
+
+    pub fn setFitting(self: *Layout, fitting: Fitting) void {
+        if (fitting == self.fitting) return;
+        self.fitting = fitting;
+        self.refitAll();
+    }
+
+    /// Shape and fit paragraphs changed since the last update. Rasterizes new glyphs into the atlas.
+    pub fn update(self: *Layout) !void {
+        if (self.dirty_start < self.dirty_end) {
+            for (self.paragraphs.items[self.dirty_start..self.dirty_end]) |paragraph| {
+                if (!paragraph.shaped) try self.shapeParagraph(paragraph);
+                if (!paragraph.fitted) try self.fit(paragraph);
+            }
+            self.positioned = @min(self.positioned, self.dirty_start);
+            self.dirty_start = 0;
+            self.dirty_end = 0;
+        }
+
+        // Line numbers only change after the first changed paragraph.
+        var line: usize = 0;
+        if (self.positioned > 0) {
+            const last = self.paragraphs.items[self.positioned - 1];
+            line = last.first_line + last.lines.items.len;
+        }
+        for (self.paragraphs.items[self.positioned..]) |paragraph| {
+            paragraph.first_line = line;
+            line += paragraph.lines.items.len;
+        }
+        self.positioned = self.paragraphs.items.len;
+        self.line_count = line;
+    }
+
+    /// Number of lines, as of the last `update()`.
+    pub fn lineCount(self: *const Layout) usize {
+        return self.line_count;
+    }
+
+    pub fn height(self: *const Layout) i32 {
+        return @intCast(self.line_count * @as(usize, @intCast(self.line_height)));
+    }
+
+    /// Append glyphs of the lines that overlap the range from `top` to `bottom`, relative to the top left corner of the
+    /// layout. Lines are as of the last `update()`. Returns false if glyphs were left out because the atlas is full
+    /// (see `FontLibrary.rasterizeAvailable()`).
+    pub fn appendGlyphs(self: *Layout, shapes: *std.ArrayList(GlyphShape), top: i32, bottom: i32) !bool {
+        if (self.line_count == 0 or bottom <= top or bottom <= 0) return true;
+        const first_line: usize = @intCast(@divFloor(@max(top, 0), self.line_height));
+        const last_line: usize = @intCast(@divFloor(bottom - 1, self.line_height));
+        const end_line = @min(last_line + 1, self.line_count);
+        if (first_line >= end_line) return true;
+
+        var complete = true;
+        var index = self.findParagraph(first_line);
+        while (index < self.paragraphs.items.len) : (index += 1) {
+            const paragraph = self.paragraphs.items[index];
+            if (paragraph.first_line >= end_line) break;
+
+            const start = @max(first_line, paragraph.first_line) - paragraph.first_line;
+            const end = @min(end_line - paragraph.first_line, paragraph.lines.items.len);
+            for (start..end) |i| {
+                const y: i32 = @intCast((paragraph.first_line + i) * @as(usize, @intCast(self.line_height)));
+                const line = paragraph.lines.items[i];
+                if (!try self.appendLine(shapes, paragraph, line, y + self.baseline)) complete = false;
+            }
+        }
+        return complete;
+    }
+
+    fn replace(self: *Layout, index: usize, count: usize, texts: []const []const u8) !void {
+        var created = std.ArrayList(*Paragraph).init(self.allocator);
+        defer created.deinit();
+        errdefer {
+            for (created.items) |paragraph| paragraph.destroy(self.allocator);
+        }
+        for (texts) |text| {
+            try created.append(try Paragraph.create(self.allocator, text));
+        }
+
+        try self.paragraphs.ensureUnusedCapacity(created.items.len);
+        for (self.paragraphs.items[index..][0..count]) |paragraph| {
+            paragraph.destroy(self.allocator);
+        }
+        // Can't fail with the capacity reserved above.
+        self.paragraphs.replaceRange(index, count, created.items) catch unreachable;
+
+        // Paragraphs after the replaced ones moved, extend the dirty range to cover them.
+        if (self.dirty_start < self.dirty_end) {
+            self.dirty_start = @min(self.dirty_start, index);
+            self.dirty_end = @max(self.dirty_end, index + count) - count + texts.len;
+        } else {
+            self.dirty_start = index;
+            self.dirty_end = index + texts.len;
+        }
+        self.positioned = @min(self.positioned, index);
+        self.version += 1;
+    }
+
+    fn refitAll(self: *Layout) void {
+        for (self.paragraphs.items) |paragraph| {
+            paragraph.fitted = false;
+        }
+        self.dirty_start = 0;
+        self.dirty_end = self.paragraphs.items.len;
+        self.version += 1;
+    }
+
+    /// Index of the paragraph containing the line.
+    fn findParagraph(self: *const Layout, line: usize) usize {
+        var low: usize = 0;
+        var high: usize = self.paragraphs.items.len;
+        while (high - low > 1) {
+            const middle = low + (high - low) / 2;
+            if (self.paragraphs.items[middle].first_line <= line) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    /// Split the paragraph into words at line break opportunities and shape them.
+    fn shapeParagraph(self: *Layout, paragraph: *Paragraph) !void {
+        paragraph.glyphs.clearRetainingCapacity();
+        paragraph.pieces.clearRetainingCapacity();
+        paragraph.words.clearRetainingCapacity();
+
+        const text = paragraph.text;
+        try self.levels.resize(text.len);
+        const levels = self.levels.items;
+        paragraph.level = try bidi.resolveLevels(self.allocator, text, levels);
+
+        var breaks = line_break.Iterator.init(text);
+        var start: usize = 0;
+        while (breaks.next()) |opportunity| {
+            const end = opportunity.index;
+            const content_end = start + std.mem.trimRight(u8, text[start..end], " \t").len;
+            var word = Word{
+                .piece_start = @intCast(paragraph.pieces.items.len),
+                .piece_count = 0,
+                .width = 0,
+                .space = 0,
+            };
+
+            // Split the word where the bidi level changes, for example at numbers in right-to-left text.
+            var piece_start = start;
+            while (piece_start < content_end) {
+                var piece_end = piece_start + 1;
+                while (piece_end < content_end and levels[piece_end] == levels[piece_start]) piece_end += 1;
+
+                const level = levels[piece_start];
+                const glyph_start = paragraph.glyphs.items.len;
+                const piece = text[piece_start..piece_end];
+                const rtl = bidi.isRtl(level);
+                const advance = try font.appendGlyphPositions(&paragraph.glyphs, self.library, piece, self.size, rtl);
+                try paragraph.pieces.append(.{
+                    .glyph_start = @intCast(glyph_start),
+                    .glyph_count = @intCast(paragraph.glyphs.items.len - glyph_start),
+                    .advance = advance,
+                    .level = level,
+                });
+                word.piece_count += 1;
+                word.width += advance;
+                piece_start = piece_end;
+            }
+
+            // Trailing whitespace is only measured, its glyphs are never drawn.
+            if (content_end < end) {
+                const glyph_count = paragraph.glyphs.items.len;
+                const space = text[content_end..end];
+                word.space = try font.appendGlyphPositions(&paragraph.glyphs, self.library, space, self.size, false);
+                paragraph.glyphs.shrinkRetainingCapacity(glyph_count);
+            }
+            try paragraph.words.append(word);
+            start = end;
+        }
+        paragraph.shaped = true;
+        paragraph.fitted = false;
+    }
+
+    fn fit(self: *Layout, paragraph: *Paragraph) !void {
+        paragraph.lines.clearRetainingCapacity();
+        paragraph.fitted = true;
+
+        const words = paragraph.words.items;
+        if (words.len == 0) {
+            // Empty paragraphs still take a line.
+            try paragraph.lines.append(.{ .word_start = 0, .word_count = 0, .width = 0 });
+            return;
+        }
+        switch (self.fitting) {
+            .greedy => try self.fitGreedy(paragraph),
+            .optimal => try self.fitOptimal(paragraph),
+        }
+    }
+
+    fn fitGreedy(self: *Layout, paragraph: *Paragraph) !void {
+        const words = paragraph.words.items;
+        var start: usize = 0;
+        var width: i64 = 0;
+        var space: i64 = 0; // Trailing whitespace of the last word on the line.
+        for (words, 0..) |word, i| {
+            if (i > start and width + space + word.width > self.max_width) {
+                try paragraph.lines.append(makeLine(start, i, width));
+                start = i;
+                width = 0;
+                space = 0;
+            }
+            width += space + word.width;
+            space = word.space;
+        }
+        try paragraph.lines.append(makeLine(start, words.len, width));
+    }
+
+    fn fitOptimal(self: *Layout, paragraph: *Paragraph) !void {
+        const words = paragraph.words.items;
+        const n = words.len;
+
+        // widths[i] is the width of the first `i` words including their trailing whitespace.
+        try self.widths.resize(n + 1);
+        const widths = self.widths.items;
+        widths[0] = 0;
+        for (words, 0..) |word, i| {
+            widths[i + 1] = widths[i] + word.width + word.space;
+        }
+
+        // Everything fits on one line, which is also the only case where the search below would be quadratic.
+        if (widths[n] - words[n - 1].space <= self.max_width) {
+            try paragraph.lines.append(makeLine(0, n, widths[n] - words[n - 1].space));
+            return;
+        }
+
+        // costs[j] is the lowest cost of breaking the first `j` words into lines, the last of which starts at
+        // previous[j].
+        try self.costs.resize(n + 1);
+        try self.previous.resize(n + 1);
+        const costs = self.costs.items;
+        const previous = self.previous.items;
+        costs[0] = 0;
+        for (1..n + 1) |j| {
+            costs[j] = std.math.inf(f64);
+            var i = j;
+            while (i > 0) {
+                i -= 1;
+                const width = widths[j] - widths[i] - words[j - 1].space;
+                // A word that doesn't fit on its own overflows, longer lines only get wider.
+                if (width > self.max_width and i + 1 < j) break;
+
+                const free: f64 = @floatFromInt(self.max_width - width);
+                const badness: f64 = if (width > self.max_width)
+                    free * free * 1000
+                else if (j == n)
+                    0 // The last line can be as short as it needs.
+                else
+                    free * free;
+                if (costs[i] + badness < costs[j]) {
+                    costs[j] = costs[i] + badness;
+                    previous[j] = @intCast(i);
+                }
+            }
+        }
+
+        // Walk the breaks back from the end, then reverse the lines.
+        var end = n;
+        while (end > 0) {
+            const start = previous[end];
+            try paragraph.lines.append(makeLine(start, end, widths[end] - widths[start] - words[end - 1].space));
+            end = start;
+        }
+        std.mem.reverse(Line, paragraph.lines.items);
+    }
+
+    /// Place glyphs of a line, reordering pieces of right-to-left text. Returns false if glyphs were left out because
+    /// the atlas is full.
+    fn appendLine(
+        self: *Layout,
+        shapes: *std.ArrayList(GlyphShape),
+        paragraph: *const Paragraph,
+        line: Line,
+        baseline: i32,
+    ) !bool {
+        self.placements.clearRetainingCapacity();
+        const words = paragraph.words.items[line.word_start..][0..line.word_count];
+        for (words, 0..) |word, i| {
+            for (word.piece_start..word.piece_start + word.piece_count) |p| {
+                const last = p + 1 == word.piece_start + word.piece_count;
+                // Whitespace at the end of the line hangs (L1).
+                const space = if (last and i + 1 < words.len) word.space else 0;
+                try self.placements.append(.{
+                    .piece = @intCast(p),
+                    .space = space,
+                    .level = paragraph.pieces.items[p].level,
+                });
+            }
+        }
+        reorder(self.placements.items);
+
+        // Lines of right-to-left paragraphs are aligned to the right.
+        var x: i32 = 0;
+        if (bidi.isRtl(paragraph.level) and self.max_width != std.math.maxInt(i32)) {
+            x = self.max_width - line.width;
+        }
+
+        // Render new glyphs of the line in one batch.
+        self.keys.clearRetainingCapacity();
+        for (self.placements.items) |placement| {
+            const piece = paragraph.pieces.items[placement.piece];
+            try self.keys.ensureUnusedCapacity(piece.glyph_count);
+            for (paragraph.glyphs.items[piece.glyph_start..][0..piece.glyph_count]) |glyph| {
+                self.keys.appendAssumeCapacity(glyph.key);
+            }
+        }
+        const rasterized = try self.library.rasterizeAvailable(self.keys.items);
+
+        const pixel_size: u16 = @intCast(self.size * self.library.dpr);
+        for (self.placements.items) |placement| {
+            const piece = paragraph.pieces.items[placement.piece];
+            const rtl = bidi.isRtl(placement.level);
+            if (rtl) x += placement.space;
+
+            try shapes.ensureUnusedCapacity(piece.glyph_count);
+            for (paragraph.glyphs.items[piece.glyph_start..][0..piece.glyph_count]) |glyph| {
+                const info = self.library.lookupGlyph(glyph.key, rasterized) orelse continue;
+                // Whitespace has nothing to draw.
+                if (info.width == 0) continue;
+                shapes.appendAssumeCapacity(font.placeGlyph(glyph, info, pixel_size, x, baseline));
+            }
+            x += piece.advance;
+            if (!rtl) x += placement.space;
+        }
+        return rasterized;
+    }
+};
+
+fn makeLine(start: usize, end: usize, width: i64) Line {
+    return .{ .word_start = @intCast(start), .word_count = @intCast(end - start), .width = @intCast(width) };
+}
+
+/// Reverse runs of pieces from the highest level down to the lowest odd level (L2).
+fn reorder(placements: []Placement) void {
+    var highest: u8 = 0;
+    var lowest: u8 = std.math.maxInt(u8);
+    for (placements) |placement| {
+        highest = @max(highest, placement.level);
+        lowest = @min(lowest, placement.level);
+    }
+    const lowest_odd = lowest | 1;
+
+    var level = highest;
+    while (level >= lowest_odd) : (level -= 1) {
+        var i: usize = 0;
+        while (i < placements.len) {
+            if (placements[i].level < level) {
+                i += 1;
+                continue;
+            }
+            var end = i;
+            while (end < placements.len and placements[end].level >= level) end += 1;
+            std.mem.reverse(Placement, placements[i..end]);
+            i = end;
+        }
+    }
+}
+
+/// Split text at mandatory line breaks. Text ending with a line break has an empty last paragraph, like in a text
+/// editor.
+fn splitParagraphs(text: []const u8, texts: *std.ArrayList([]const u8)) !void {
+    var breaks = line_break.Iterator.init(text);
+    var start: usize = 0;
+    while (breaks.next()) |opportunity| {
+        if (!opportunity.mandatory) continue;
+        try texts.append(trimNewline(text[start..opportunity.index]));
+        start = opportunity.index;
+    }
+    try texts.append(text[start..]);
+}
+
+fn trimNewline(text: []const u8) []const u8 {
+    inline for (.{ "\r\n", "\n", "\r", "\x0B", "\x0C", "\u{85}", "\u{2028}", "\u{2029}" }) |newline| {
+        if (std.mem.endsWith(u8, text, newline)) return text[0 .. text.len - newline.len];
+    }
+    return text;
+}
+
+test "reorder reverses right-to-left runs and keeps numbers in them left to right" {
+    // Left-to-right paragraph: a word, right-to-left words around a number of two pieces, a word.
+    const levels = [_]u8{ 0, 1, 2, 2, 1, 0 };
+    var placements: [levels.len]Placement = undefined;
+    for (&placements, levels, 0..) |*placement, level, i| {
+        placement.* = .{ .piece = @intCast(i), .space = 0, .level = level };
+    }
+    reorder(&placements);
+
+    var order: [levels.len]u32 = undefined;
+    for (placements, &order) |placement, *piece| piece.* = placement.piece;
+    try std.testing.expectEqualSlices(u32, &.{ 0, 4, 2, 3, 1, 5 }, &order);
+}
+
+test "reorder reverses a right-to-left line" {
+    var placements = [_]Placement{
+        .{ .piece = 0, .space = 0, .level = 1 },
+        .{ .piece = 1, .space = 0, .level = 1 },
+        .{ .piece = 2, .space = 0, .level = 2 },
+    };
+    reorder(&placements);
+    try std.testing.expectEqual(@as(u32, 2), placements[0].piece);
+    try std.testing.expectEqual(@as(u32, 1), placements[1].piece);
+    try std.testing.expectEqual(@as(u32, 0), placements[2].piece);
+}
+
+/// Advance of text shaped the way `Layout` shapes words (in px).
+fn measure(library: *FontLibrary, text: []const u8) !i32 {
+    var positions = std.ArrayList(font.GlyphPosition).init(std.testing.allocator);
+    defer positions.deinit();
+    return font.appendGlyphPositions(&positions, library, text, font.font_size, false);
+}
+
+fn expectLines(paragraph: *const Paragraph, word_counts: []const u32, widths: []const i32) !void {
+    try std.testing.expectEqual(word_counts.len, paragraph.lines.items.len);
+    var word_start: u32 = 0;
+    for (paragraph.lines.items, word_counts, widths) |line, word_count, width| {
+        try std.testing.expectEqual(word_start, line.word_start);
+        try std.testing.expectEqual(word_count, line.word_count);
+        try std.testing.expectEqual(width, line.width);
+        word_start += word_count;
+    }
+}
+
+/// Words of a paragraph that greedy fitting breaks as [xxx xx] [xx] [xxxxx] and optimal fitting as [xxx] [xx xx]
+/// [xxxxx], at the width returned by `wrapWidth()`.
+const WRAPPED = "xxx xx xx xxxxx";
+
+fn wrapWidth(library: *FontLibrary) !i32 {
+    const xxx = try measure(library, "xxx");
+    const space = try measure(library, " ");
+    const xx = try measure(library, "xx");
+    return xxx + space + xx;
+}
+
+test "fitting lines to the width" {
+    const allocator = std.testing.allocator;
+    var library = try FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer library.deinit();
+
+    const space = try measure(&library, " ");
+    const xx = try measure(&library, "xx");
+    const xxx = try measure(&library, "xxx");
+    const xxxxx = try measure(&library, "xxxxx");
+    const max_width = try wrapWidth(&library);
+
+    var layout = Layout.init(allocator, &library, .{ .max_width = max_width });
+    defer layout.deinit();
+    try layout.setText(WRAPPED);
+    try layout.update();
+    try std.testing.expectEqual(@as(usize, 3), layout.lineCount());
+    try expectLines(layout.paragraphs.items[0], &.{ 2, 1, 1 }, &.{ xxx + space + xx, xx, xxxxx });
+
+    // Refitting keeps the shaped words.
+    const paragraph = layout.paragraphs.items[0];
+    layout.setFitting(.optimal);
+    try std.testing.expect(paragraph.shaped and !paragraph.fitted);
+    try layout.update();
+    try std.testing.expectEqual(paragraph, layout.paragraphs.items[0]);
+    try expectLines(paragraph, &.{ 1, 2, 1 }, &.{ xxx, xx + space + xx, xxxxx });
+
+    // Everything fits on one line, trailing whitespace isn't part of the width.
+    layout.setMaxWidth(std.math.maxInt(i32));
+    try layout.update();
+    try expectLines(paragraph, &.{4}, &.{xxx + xx + xx + xxxxx + 3 * space});
+
+    // A word wider than the line overflows it on a line of its own.
+    layout.setFitting(.greedy);
+    layout.setMaxWidth(1);
+    try layout.update();
+    try expectLines(paragraph, &.{ 1, 1, 1, 1 }, &.{ xxx, xx, xx, xxxxx });
+}
+
+test "editing keeps untouched paragraphs and renumbers lines" {
+    const allocator = std.testing.allocator;
+    var library = try FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer library.deinit();
+
+    var layout = Layout.init(allocator, &library, .{ .max_width = try wrapWidth(&library) });
+    defer layout.deinit();
+    try layout.setText("one\ntwo\nthree\nfour");
+    try layout.update();
+    try std.testing.expectEqual(@as(usize, 4), layout.lineCount());
+    const old = try allocator.dupe(*Paragraph, layout.paragraphs.items);
+    defer allocator.free(old);
+
+    // Same text: nothing changes.
+    const version = layout.version;
+    try layout.setText("one\ntwo\nthree\nfour");
+    try std.testing.expectEqual(version, layout.version);
+
+    // Only the edited paragraph is replaced, the common prefix and suffix are kept with their shaping.
+    try layout.setText("one\n" ++ WRAPPED ++ "\nthree\nfour");
+    try std.testing.expect(layout.version > version);
+    try std.testing.expectEqual(@as(usize, 4), layout.paragraphCount());
+    for ([_]usize{ 0, 2, 3 }) |i| {
+        try std.testing.expectEqual(old[i], layout.paragraphs.items[i]);
+        try std.testing.expect(layout.paragraphs.items[i].shaped);
+    }
+    try std.testing.expect(!layout.paragraphs.items[1].shaped);
+    try std.testing.expectEqual(@as(usize, 1), layout.dirty_start);
+    try std.testing.expectEqual(@as(usize, 2), layout.dirty_end);
+    try std.testing.expectEqual(@as(usize, 1), layout.positioned);
+
+    // Lines after the edit are numbered from the last paragraph before it.
+    try layout.update();
+    try std.testing.expectEqual(@as(usize, 6), layout.lineCount());
+    for (layout.paragraphs.items, [_]usize{ 0, 1, 4, 5 }) |paragraph, first_line| {
+        try std.testing.expectEqual(first_line, paragraph.first_line);
+    }
+    for ([_]usize{ 0, 1, 1, 1, 2, 3 }, 0..) |index, line| {
+        try std.testing.expectEqual(index, layout.findParagraph(line));
+    }
+}
+
+test "dirty range covers paragraphs edited before an update" {
+    const allocator = std.testing.allocator;
+    var library = try FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer library.deinit();
+
+    var layout = Layout.init(allocator, &library, .{});
+    defer layout.deinit();
+    try layout.setText("a\nb\nc\nd\ne");
+    try layout.update();
+
+    // [a b c x y e], x and y are dirty.
+    try layout.replaceParagraphs(3, 1, "x\ny");
+    try std.testing.expectEqual(@as(usize, 3), layout.dirty_start);
+    try std.testing.expectEqual(@as(usize, 5), layout.dirty_end);
+
+    // [a c x y e], the dirty range moves back with x and y and extends to the removal.
+    try layout.removeParagraphs(1, 1);
+    try std.testing.expectEqual(@as(usize, 1), layout.dirty_start);
+    try std.testing.expectEqual(@as(usize, 4), layout.dirty_end);
+
+    // [n a c x y e], inserting before the range shifts its end.
+    try layout.replaceParagraphs(0, 0, "n");
+    try std.testing.expectEqual(@as(usize, 0), layout.dirty_start);
+    try std.testing.expectEqual(@as(usize, 5), layout.dirty_end);
+    try std.testing.expectEqual(@as(usize, 0), layout.positioned);
+
+    try layout.update();
+    try std.testing.expectEqual(@as(usize, 6), layout.lineCount());
+    for (layout.paragraphs.items, "nacxye", 0..) |paragraph, text, line| {
+        try std.testing.expectEqualStrings(&.{text}, paragraph.text);
+        try std.testing.expect(paragraph.shaped and paragraph.fitted);
+        try std.testing.expectEqual(line, paragraph.first_line);
+    }
+}
+
+test "glyphs of the visible lines only" {
+    const allocator = std.testing.allocator;
+    var library = try FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer library.deinit();
+
+    var layout = Layout.init(allocator, &library, .{ .max_width = try wrapWidth(&library) });
+    defer layout.deinit();
+    // Lines: a, xxx xx, xx, xxxxx, bb.
+    try layout.setText("a\n" ++ WRAPPED ++ "\nbb");
+    try layout.update();
+    try std.testing.expectEqual(@as(usize, 5), layout.lineCount());
+
+    var shapes = std.ArrayList(GlyphShape).init(allocator);
+    defer shapes.deinit();
+    const line_height = layout.line_height;
+    const Window = struct { top: i32, bottom: i32, glyphs: usize };
+    for ([_]Window{
+        .{ .top = 0, .bottom = line_height, .glyphs = 1 },
+        .{ .top = line_height, .bottom = 2 * line_height, .glyphs = 5 }, // Spaces have nothing to draw.
+        .{ .top = 2 * line_height - 1, .bottom = 3 * line_height + 1, .glyphs = 5 + 2 + 5 },
+        .{ .top = 4 * line_height, .bottom = 10 * line_height, .glyphs = 2 },
+        .{ .top = -line_height, .bottom = 0, .glyphs = 0 },
+        .{ .top = 5 * line_height, .bottom = 6 * line_height, .glyphs = 0 },
+    }) |window| {
+        shapes.clearRetainingCapacity();
+        try std.testing.expect(try layout.appendGlyphs(&shapes, window.top, window.bottom));
+        try std.testing.expectEqual(window.glyphs, shapes.items.len);
+        for (shapes.items) |shape| {
+            // Glyphs sit on the baseline of their line, which overlaps the window.
+            const line = @divFloor(shape.y + shape.glyph.bearing_y - layout.baseline, line_height);
+            try std.testing.expect((line + 1) * line_height > window.top);
+            try std.testing.expect(line * line_height < window.bottom);
+        }
+    }
+}
@@ -0,0 +1,452 @@
+const std = @import("std");
+
+// Line break opportunities following the Unicode Line Breaking Algorithm (UAX #14,
+// https://www.unicode.org/reports/tr14/).
+//
+// Classes are assigned by ranges tuned to the scripts the app has fonts for (Latin, Cyrillic, Devanagari, Arabic,
+// Japanese and emoji); elsewhere whole blocks get the class of most of their characters. Classes that the algorithm
+// resolves to others (AI, SG, SA and XX to AL, CJ to NS for strict breaking, HL to AL) are resolved directly, and
+// Hangul syllables are treated as ideographs.
+
+/// Line breaking class of a character.
+pub const Class = enum {
+    bk, // Mandatory break.
+    cr, // Carriage return.
+    lf, // Line feed.
+    nl, // Next line.
+    sp, // Space.
+    zw, // Zero width space.
+    wj, // Word joiner.
+    gl, // Non-breaking ("glue").
+    zwj, // Zero width joiner.
+    cm, // Combining mark.
+    op, // Opening punctuation.
+    cl, // Closing punctuation.
+    cp, // Closing parenthesis.
+    qu, // Quotation.
+    ex, // Exclamation or interrogation.
+    is, // Infix numeric separator.
+    sy, // Symbol allowing break after.
+    nu, // Numeric.
+    pr, // Prefix numeric.
+    po, // Postfix numeric.
+    al, // Alphabetic.
+    id, // Ideographic.
+    in, // Inseparable.
+    eb, // Emoji base.
+    em, // Emoji modifier.
+    hy, // Hyphen.
+    ba, // Break after.
+    bb, // Break before.
+    b2, // Break opportunity before and after.
+    ns, // Nonstarter.
+    ri, // Regional indicator.
+
+    fn isNewline(self: Class) bool {
+        return self == .bk or self == .cr or self == .lf or self == .nl;
+    }
+};
+
+pub const Break = struct {
+    index: usize, // Byte offset where the next line would start.
+    mandatory: bool, // Text after the break has to start a new line (paragraph end).
+};
+
+/// Iterates over line break opportunities in UTF-8 text. The end of the text is always returned as the last break,
+/// mandatory only if the text ends with a newline. Empty text has no breaks.
+pub const Iterator = struct {
+    text: []const u8,
+    index: usize, // Next byte to read.
+    done: bool,
+
+    previous: ?Class, // Class of the last character that isn't a space (after LB9 and LB10), null at start of text.
+    spaces: bool, // Whether spaces follow `previous`.
+    zwj: bool, // Last character was a zero width joiner.
+    regional_indicators: usize, // Number of regional indicators in a row, before the current character.
+
+    pub fn init(text: []const u8) Iterator {
+        return .{
+            .text = text,
+            .index = 0,
+            .done = false,
+            .previous = null,
+            .spaces = false,
+            .zwj = false,
+            .regional_indicators = 0,
+        };
+    }
+
+    pub fn next(self: *Iterator) ?Break {
+        while (self.index < self.text.len) {
+            const start = self.index;
+            const length = std.unicode.utf8ByteSequenceLength(self.text[start]) catch 1;
+            self.index = @min(start + length, self.text.len);
+            const bytes = self.text[start..self.index];
+            const codepoint = std.unicode.utf8Decode(bytes) catch std.unicode.replacement_character;
+
+            if (self.step(classify(codepoint))) |mandatory| {
+                return .{ .index = start, .mandatory = mandatory };
+            }
+        }
+
+        if (self.done or self.text.len == 0) return null;
+        self.done = true;
+        // LB3: always break at the end of text.
+        const newline = self.previous != null and self.previous.?.isNewline();
+        return .{ .index = self.text.len, .mandatory = newline };
+    }
+
+    /// Decide whether there is a break before a character of class `class` and update the state. Returns null if there
+    /// is no break, otherwise whether the break is mandatory.
+    fn step(self: *Iterator, class: Class) ?bool {
+        var current = class;
+        // LB2: never break at the start of text. Leading spaces stay with the first word.
+        const before = self.previous orelse {
+            if (current != .sp) self.advance(if (current == .cm or current == .zwj) .al else current, current);
+            return null;
+        };
+        const after_spaces = self.spaces;
+
+        // LB4 and LB5: break after newlines, except between CR and LF. The next line starts like a new text.
+        if (before.isNewline()) {
+            if (before == .cr and current == .lf) {
+                self.advance(current, current);
+                return null;
+            }
+            self.previous = null;
+            _ = self.step(class);
+            return true;
+        }
+        // LB6: don't break before newlines.
+        if (current.isNewline()) {
+            self.advance(current, current);
+            return null;
+        }
+        // LB7: don't break before spaces or zero width space.
+        if (current == .sp) {
+            self.spaces = true;
+            self.zwj = false;
+            self.regional_indicators = 0;
+            return null;
+        }
+        if (current == .zw) {
+            self.advance(current, current);
+            return null;
+        }
+        // LB8: break after zero width space, even if followed by spaces.
+        if (before == .zw) {
+            self.advance(if (current == .cm or current == .zwj) .al else current, current);
+            return false;
+        }
+        // LB8a: don't break after zero width joiner.
+        if (self.zwj and !after_spaces) {
+            self.advance(if (current == .cm or current == .zwj) before else current, current);
+            return null;
+        }
+        // LB9: combining marks and joiners take the class of the character they follow.
+        if (current == .cm or current == .zwj) {
+            if (!after_spaces) {
+                self.zwj = current == .zwj;
+                return null;
+            }
+            // LB10: standalone marks are alphabetic.
+            current = .al;
+        }
+
+        const result = breakBetween(before, current, after_spaces, self.regional_indicators);
+        self.advance(current, class);
+        return if (result) false else null;
+    }
+
+    fn advance(self: *Iterator, resolved: Class, original: Class) void {
+        self.regional_indicators = if (resolved == .ri) self.regional_indicators + 1 else 0;
+        self.previous = resolved;
+        self.spaces = false;
+        self.zwj = original == .zwj;
+    }
+};
+
+/// Pair rules LB11 to LB31 for two characters, possibly separated by spaces.
+fn breakBetween(before: Class, after: Class, spaces: bool, regional_indicators: usize) bool {
+    // LB11: don't break around word joiners.
+    if (after == .wj or (before == .wj and !spaces)) return false;
+    // LB12: don't break after non-breaking characters.
+    if (before == .gl and !spaces) return false;
+    // LB12a: don't break before non-breaking characters, except after spaces and hyphens.
+    if (after == .gl and !spaces and before != .ba and before != .hy) return false;
+    // LB13: don't break before closing punctuation, even after spaces.
+    switch (after) {
+        .cl, .cp, .ex, .is, .sy => return false,
+        else => {},
+    }
+    // LB14: don't break after opening punctuation, even after spaces.
+    if (before == .op) return false;
+    // LB15: don't break inside quote followed by opening punctuation.
+    if (before == .qu and after == .op) return false;
+    // LB16: don't break between closing punctuation and nonstarters.
+    if ((before == .cl or before == .cp) and after == .ns) return false;
+    // LB17: don't break within em dashes.
+    if (before == .b2 and after == .b2) return false;
+    // LB18: break after spaces.
+    if (spaces) return true;
+    // LB19: don't break around quotation marks.
+    if (before == .qu or after == .qu) return false;
+    // LB21: don't break before hyphens, small kana and similar, and after break-before characters.
+    if (after == .ba or after == .hy or after == .ns or before == .bb) return false;
+    // LB22: don't break before ellipses.
+    if (after == .in) return false;
+    // LB23: don't break between letters and digits.
+    if ((before == .al and after == .nu) or (before == .nu and after == .al)) return false;
+    // LB23a: don't break between numeric prefixes and ideographs, or ideographs and postfixes.
+    if (before == .pr and (after == .id or after == .eb or after == .em)) return false;
+    if ((before == .id or before == .eb or before == .em) and after == .po) return false;
+    // LB24: don't break between numeric prefixes or postfixes and letters.
+    if ((before == .pr or before == .po) and after == .al) return false;
+    if (before == .al and (after == .pr or after == .po)) return false;
+    // LB25: don't break inside numbers (pair-wise approximation from the standard).
+    switch (before) {
+        .cl, .cp, .nu => if (after == .po or after == .pr) return false,
+        else => {},
+    }
+    switch (before) {
+        .po, .pr => if (after == .op or after == .nu) return false,
+        .hy, .is, .nu, .sy => if (after == .nu) return false,
+        else => {},
+    }
+    // LB28: don't break between letters.
+    if (before == .al and after == .al) return false;
+    // LB29: don't break between infix separators and letters ("e.g.").
+    if (before == .is and after == .al) return false;
+    // LB30: don't break between letters or digits and parentheses.
+    if ((before == .al or before == .nu) and after == .op) return false;
+    if (before == .cp and (after == .al or after == .nu)) return false;
+    // LB30a: break between pairs of regional indicators (flags).
+    if (before == .ri and after == .ri and regional_indicators % 2 == 1) return false;
+    // LB30b: don't break between emoji bases and modifiers.
+    if (before == .eb and after == .em) return false;
+    // LB31: break everywhere else.
+    return true;
+}
+
+/// Line breaking class of a codepoint.
+pub fn classify(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0000...0x007F => ascii(@intCast(codepoint)),
+        0x0080...0x00FF => latin1(@intCast(codepoint)),
+        0x02C8, 0x02CC, 0x02DF => .bb,
+        0x0300...0x036F, 0x0483...0x0489 => .cm,
+        0x0590...0x05FF => hebrew(codepoint),
+        0x0600...0x06FF => arabic(codepoint),
+        0x08D3...0x08FF => .cm,
+        0x0900...0x097F => devanagari(codepoint),
+        0x1100...0x115F => .id,
+        0x1160...0x11FF => .cm,
+        0x1680 => .ba,
+        0x1AB0...0x1AFF, 0x1DC0...0x1DFF => .cm,
+        0x2000...0x206F => punctuation(codepoint),
+        0x20A0...0x20CF => .pr,
+        0x20D0...0x20FF => .cm,
+        0x2600...0x27BF => symbol(codepoint),
+        0x2E80...0x2FFF => .id,
+        0x3000...0x30FF => kana(codepoint),
+        0x3100...0x4DBF, 0x4E00...0xA4CF, 0xAC00...0xD7A3, 0xF900...0xFAFF, 0xFE30...0xFE4F => .id,
+        0xFE00...0xFE0F, 0xFE20...0xFE2F => .cm,
+        0xFEFF => .wj,
+        0xFF00...0xFFEF => fullwidth(codepoint),
+        0x1F000...0x1FAFF => emoji(codepoint),
+        0x1FC00...0x1FFFD, 0x20000...0x3FFFD => .id,
+        0xE0000...0xE0FFF => .cm,
+        else => .al,
+    };
+}
+
+fn ascii(c: u8) Class {
+    return switch (c) {
+        '\t', '|' => .ba,
+        '\n' => .lf,
+        0x0B, 0x0C => .bk,
+        '\r' => .cr,
+        ' ' => .sp,
+        '!', '?' => .ex,
+        '"', '\'' => .qu,
+        '$', '+', '\\' => .pr,
+        '%' => .po,
+        '(', '[', '{' => .op,
+        ')', ']' => .cp,
+        '}' => .cl,
+        ',', '.', ':', ';' => .is,
+        '-' => .hy,
+        '/' => .sy,
+        '0'...'9' => .nu,
+        0x00...0x08, 0x0E...0x1F, 0x7F => .cm,
+        else => .al,
+    };
+}
+
+fn latin1(c: u8) Class {
+    return switch (c) {
+        0x85 => .nl,
+        0x80...0x84, 0x86...0x9F => .cm,
+        0xA0 => .gl,
+        0xA1, 0xBF => .op,
+        0xA2, 0xB0 => .po,
+        0xA3...0xA5, 0xB1 => .pr,
+        0xAB, 0xBB => .qu,
+        0xAD => .ba,
+        0xB4 => .bb,
+        else => .al,
+    };
+}
+
+fn hebrew(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0591...0x05BD, 0x05BF, 0x05C1, 0x05C2, 0x05C4, 0x05C5, 0x05C7 => .cm,
+        0x05BE => .ba,
+        else => .al,
+    };
+}
+
+fn arabic(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0609...0x060B, 0x066A => .po,
+        0x060C, 0x060D => .is,
+        0x0610...0x061A, 0x061C, 0x064B...0x065F, 0x0670, 0x06D6...0x06DC, 0x06DF...0x06E4, 0x06E7, 0x06E8,
+        0x06EA...0x06ED,
+        => .cm,
+        0x061B, 0x061E, 0x061F, 0x06D4 => .ex,
+        0x0660...0x0669, 0x066B, 0x066C, 0x06F0...0x06F9 => .nu,
+        else => .al,
+    };
+}
+
+fn devanagari(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x0900...0x0903, 0x093A...0x093C, 0x093E...0x094F, 0x0951...0x0957, 0x0962, 0x0963 => .cm,
+        0x0964, 0x0965 => .ba,
+        0x0966...0x096F => .nu,
+        else => .al,
+    };
+}
+
+fn punctuation(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x2000...0x2006, 0x2008...0x200A, 0x2010, 0x2012, 0x2013, 0x2027 => .ba,
+        0x2007, 0x2011, 0x202F => .gl,
+        0x200B => .zw,
+        0x200C, 0x202A...0x202E, 0x2066...0x206F => .cm,
+        0x200D => .zwj,
+        0x2014 => .b2,
+        0x2018, 0x2019, 0x201B...0x201D, 0x201F, 0x2039, 0x203A => .qu,
+        0x201A, 0x201E => .op,
+        0x2024...0x2026 => .in,
+        0x2028, 0x2029 => .bk,
+        0x2030...0x2037 => .po,
+        0x203C, 0x203D, 0x2047...0x2049 => .ns,
+        0x2044 => .is,
+        0x2060 => .wj,
+        else => .al,
+    };
+}
+
+fn symbol(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x261D, 0x26F9, 0x270A...0x270D => .eb,
+        0x275B...0x2760 => .qu,
+        0x2762, 0x2763 => .ex,
+        0x2768, 0x276A, 0x276C, 0x276E, 0x2770, 0x2772, 0x2774 => .op,
+        0x2769, 0x276B, 0x276D, 0x276F, 0x2771, 0x2773, 0x2775 => .cl,
+        else => .id,
+    };
+}
+
+fn kana(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x3000 => .ba,
+        0x3001, 0x3002, 0x3009, 0x300B, 0x300D, 0x300F, 0x3011, 0x3015, 0x3017, 0x3019, 0x301B, 0x301E, 0x301F => .cl,
+        0x3008, 0x300A, 0x300C, 0x300E, 0x3010, 0x3014, 0x3016, 0x3018, 0x301A, 0x301D => .op,
+        // Iteration marks, sound marks and small kana.
+        0x3005, 0x301C, 0x303B, 0x303C, 0x309B...0x309E, 0x30A0, 0x30FB, 0x30FD, 0x30FE, 0x3041, 0x3043, 0x3045,
+        0x3047, 0x3049, 0x3063, 0x3083, 0x3085, 0x3087, 0x308E, 0x3095, 0x3096, 0x30A1, 0x30A3, 0x30A5, 0x30A7,
+        0x30A9, 0x30C3, 0x30E3, 0x30E5, 0x30E7, 0x30EE, 0x30F5, 0x30F6, 0x30FC,
+        => .ns,
+        0x302A...0x302F, 0x3099, 0x309A => .cm,
+        else => .id,
+    };
+}
+
+fn fullwidth(codepoint: u21) Class {
+    return switch (codepoint) {
+        0xFF01, 0xFF1F => .ex,
+        0xFF04, 0xFFE1, 0xFFE5, 0xFFE6 => .pr,
+        0xFF05, 0xFFE0 => .po,
+        0xFF08, 0xFF3B, 0xFF5B, 0xFF5F, 0xFF62 => .op,
+        0xFF09, 0xFF0C, 0xFF0E, 0xFF3D, 0xFF5D, 0xFF60, 0xFF61, 0xFF63, 0xFF64 => .cl,
+        0xFF1A, 0xFF1B, 0xFF65, 0xFF67...0xFF70, 0xFF9E, 0xFF9F => .ns,
+        0xFF66, 0xFF71...0xFF9D, 0xFFA0...0xFFDC, 0xFFE8...0xFFEE => .al,
+        else => .id,
+    };
+}
+
+fn emoji(codepoint: u21) Class {
+    return switch (codepoint) {
+        0x1F1E6...0x1F1FF => .ri,
+        0x1F3FB...0x1F3FF => .em,
+        0x1F385, 0x1F3C2...0x1F3C4, 0x1F3C7, 0x1F3CA...0x1F3CC, 0x1F442, 0x1F443, 0x1F446...0x1F450,
+        0x1F466...0x1F478, 0x1F47C, 0x1F481...0x1F483, 0x1F485...0x1F487, 0x1F48F, 0x1F491, 0x1F4AA, 0x1F574,
+        0x1F575, 0x1F57A, 0x1F590, 0x1F595, 0x1F596, 0x1F645...0x1F647, 0x1F64B...0x1F64F, 0x1F6A3,
+        0x1F6B4...0x1F6B6, 0x1F6C0, 0x1F6CC, 0x1F90C, 0x1F90F, 0x1F918...0x1F91F, 0x1F926, 0x1F930...0x1F939,
+        0x1F93C...0x1F93E, 0x1F977, 0x1F9B5, 0x1F9B6, 0x1F9B8, 0x1F9B9, 0x1F9BB, 0x1F9CD...0x1F9CF,
+        0x1F9D1...0x1F9DD, 0x1FAC3...0x1FAC5, 0x1FAF0...0x1FAF8,
+        => .eb,
+        else => .id,
+    };
+}
+
+fn expectBreaks(text: []const u8, expected: []const usize) !void {
+    var breaks = std.ArrayList(usize).init(std.testing.allocator);
+    defer breaks.deinit();
+    var iterator = Iterator.init(text);
+    while (iterator.next()) |opportunity| try breaks.append(opportunity.index);
+    try std.testing.expectEqualSlices(usize, expected, breaks.items);
+}
+
+test "breaks after spaces" {
+    try expectBreaks("hello world  foo", &.{ 6, 13, 16 });
+    // Leading spaces stay with the first word.
+    try expectBreaks("  hello", &.{7});
+    try expectBreaks("", &.{});
+}
+
+test "breaks between ideographs" {
+    try expectBreaks("日本語", &.{ 3, 6, 9 });
+    // Hangul syllables are treated as ideographs.
+    try expectBreaks("한국", &.{ 3, 6 });
+}
+
+test "breaks after hyphens" {
+    try expectBreaks("well-known", &.{ 5, 10 });
+    // A minus sign stays with the number.
+    try expectBreaks("a -5", &.{ 2, 4 });
+}
+
+test "no break before closing punctuation" {
+    try expectBreaks("foo (bar).", &.{ 4, 10 });
+    try expectBreaks("foo )", &.{5});
+    try expectBreaks("日本。語", &.{ 3, 9, 12 });
+    try expectBreaks("a!", &.{2});
+}
+
+test "no break inside numbers and URLs" {
+    try expectBreaks("3.14", &.{4});
+    try expectBreaks("$100 50%", &.{ 5, 8 });
+    try expectBreaks("1,000.5", &.{7});
+    // URLs only break after slashes.
+    try expectBreaks("http://a.b/c", &.{ 7, 11, 12 });
+}
+
+test "mandatory breaks" {
+    var iterator = Iterator.init("a\r\nb\n");
+    try std.testing.expectEqual(Break{ .index = 3, .mandatory = true }, iterator.next().?);
+    try std.testing.expectEqual(Break{ .index = 5, .mandatory = true }, iterator.next().?);
+    try std.testing.expect(iterator.next() == null);
+}
@@ -9,6 +9,8 @@ const assert = std.debug.assert;
 const utils = @import("utils.zig");
 const font = @import("font.zig");
 const DebugFontAtlas = @import("debug_font_atlas.zig").DebugFontAtlas;
+const GpuAtlas = @import("gpu_atlas.zig").GpuAtlas;
+const Layout = @import("layout.zig").Layout;
 const Printer = @import("printer.zig").Printer;
 const Triangle = @import("triangle.zig").Triangle;
 
@@ -62,16 +64,27 @@ pub fn main() !void {
     var triangle = Triangle.init(gctx);
     defer triangle.deinit();
 
-    var font_library = try font.FontLibrary.init(allocator, gctx, dpr);
+    var font_library = try font.FontLibrary.init(allocator, dpr, .{});
     defer font_library.deinit();
 
-    var printer = try Printer.init(allocator, gctx, &font_library, dpr);
+    var gpu_atlas = GpuAtlas.init(gctx, &font_library.glyph_cache);
+    defer gpu_atlas.deinit();
+
+    var printer = try Printer.init(allocator, gctx, &font_library, &gpu_atlas, dpr);
     defer printer.deinit();
 
-    var debug_font_atlas = DebugFontAtlas.init(gctx, font_library.atlas_texture);
+    var debug_font_atlas = DebugFontAtlas.init(gctx, gpu_atlas.texture(.gray));
     defer debug_font_atlas.deinit();
 
-    try printer.text("hello नमस्ते cześć もしもし привіт 안녕 مرحبًا 👋😀🎷🇯🇵☝🏾", 200, 200);
+    try printer.text("hello नमस्ते cześć もしもし привіт 안녕 مرحبًا 👋😀🎷🇯🇵☝🏾", 200, 200, font.font_size, .{ 1, 1, 1, 1 });
+
+    var layout = Layout.init(allocator, &font_library, .{ .max_width = @intCast(600 * dpr) });
+    defer layout.deinit();
+    try layout.setText("Lorem ipsum dolor sit amet, consectetur adipiscing elit. Ut gravida, sem vel facilisis " ++
+        "porttitor, tortor diam suscipit ipsum, at tristique nulla urna in ex. In hac habitasse platea dictumst.\n" ++
+        "لمّا كان الاعتراف بالكرامة المتأصلة في جميع أعضاء الأسرة البشرية وبحقوقهم المتساوية الثابتة هو أساس الحرية\n" ++
+        "いろはにほへと ちりぬるを わかよたれそ つねならむ");
+    try printer.layout(&layout, 200, 260, .{ 1, 1, 1, 1 });
     // try printer.text("لمّا كان الاعتراف بالكرامة مرحبًا", 200, 350);
     // try printer.text("Lorem ipsum dolor sit amet, consectetur adipiscing elit. Ut gravida, sem vel facilisis porttitor, tortor diam suscipit ipsum, at tristique nulla urna in ex. In hac habitasse platea dictumst. Cras faucibus ut dolor eu ornare. Donec eu rutrum elit. Nunc vitae libero sollicitudin, dictum quam quis, accumsan dui. Sed congue euismod dui, finibus semper quam feugiat consectetur. Integer aliquet vel odio in pulvinar. Vestibulum lobortis erat non nisl pretium tempus. Donec vestibulum sem eu erat luctus eleifend. Pellentesque at dictum tortor. Morbi ac porta ligula. Etiam euismod non ex at vestibulum. Nam in ante vel orci sodales tristique id vitae arcu. Ut quis feugiat magna, sed facilisis diam. Cras orci augue, porttitor et hendrerit vitae, suscipit ac enim.", 200, 300);
     // try printer.text("hello how are you doing?", 200, 200);
@@ -5,51 +5,150 @@ const wgpu = zgpu.wgpu;
 const zm = @import("zmath");
 const font = @import("font.zig");
 const utils = @import("utils.zig");
+const quads = @import("quads.zig");
 const FontLibrary = font.FontLibrary;
+const Layout = @import("layout.zig").Layout;
+const GpuAtlas = @import("gpu_atlas.zig").GpuAtlas;
+const Instance = quads.Instance;
 
 const wgsl_vs =
-    \\ struct VertexIn {
+    \\ struct Uniforms {
+    \\     screen_size: vec2f,
+    \\     atlas_size: vec2f,
+    \\ };
+    \\ @group(0) @binding(3) var<uniform> uniforms: Uniforms;
+    \\
+    \\ struct InstanceIn {
     \\     @location(0) position: vec2f,
-    \\     @location(1) uv: vec2f,
+    \\     @location(1) rect: vec4u,
+    \\     @location(2) atlas: vec2u,
+    \\     @location(3) color: vec4f,
+    \\     @location(4) scale: f32,
     \\ };
     \\
     \\ struct VertexOut {
     \\     @builtin(position) position: vec4f,
     \\     @location(1) uv: vec2f,
+    \\     @location(2) @interpolate(flat) page: u32,
+    \\     @location(3) @interpolate(flat) mode: u32,
+    \\     @location(4) color: vec4f,
     \\ };
     \\
-    \\ @vertex fn main(in: VertexIn) -> VertexOut {
+    \\ @vertex fn main(@builtin(vertex_index) vertex: u32, in: InstanceIn) -> VertexOut {
+    \\     var corners = array<vec2f, 6>(
+    \\         vec2f(0.0, 1.0), vec2f(1.0, 1.0), vec2f(0.0, 0.0),
+    \\         vec2f(1.0, 1.0), vec2f(1.0, 0.0), vec2f(0.0, 0.0),
+    \\     );
+    \\     let offset = corners[vertex] * vec2f(in.rect.zw);
+    \\     let pixel = (in.position + offset * in.scale) / uniforms.screen_size;
+    \\
     \\     var out: VertexOut;
-    \\     out.position = vec4f(in.position, 0.0, 1.0);
-    \\     out.uv = in.uv;
+    \\     out.position = vec4f(pixel.x * 2.0 - 1.0, 1.0 - pixel.y * 2.0, 0.0, 1.0);
+    \\     out.uv = (vec2f(in.rect.xy) + offset) / uniforms.atlas_size;
+    \\     out.page = in.atlas.x;
+    \\     out.mode = in.atlas.y;
+    \\     out.color = in.color;
     \\     return out;
     \\ }
 ;
-// TODO: now there's no support for colors as we are just rendering the RGBA of the atlas.
 const wgsl_fs =
     \\ struct VertexOut {
     \\     @builtin(position) position: vec4f,
     \\     @location(1) uv: vec2f,
+    \\     @location(2) @interpolate(flat) page: u32,
+    \\     @location(3) @interpolate(flat) mode: u32,
+    \\     @location(4) color: vec4f,
     \\ };
     \\
-    \\ @group(0) @binding(0) var t: texture_2d<f32>;
+    \\ @group(0) @binding(0) var gray_atlas: texture_2d_array<f32>;
     \\ @group(0) @binding(1) var s: sampler;
+    \\ @group(0) @binding(2) var color_atlas: texture_2d_array<f32>;
     \\
     \\ @fragment fn main(in: VertexOut) -> @location(0) vec4f {
-    \\     return textureSample(t, s, in.uv);
+    \\     // Sample both atlases and take derivatives before branching to keep control flow uniform.
+    \\     let gray = textureSample(gray_atlas, s, in.uv, in.page).r;
+    \\     let color = textureSample(color_atlas, s, in.uv, in.page);
+    \\     let width = max(fwidth(gray), 0.0001);
+    \\     if (in.mode == 1u) {
+    \\         return vec4f(color.rgb, color.a * in.color.a);
+    \\     }
+    \\     if (in.mode == 2u) {
+    \\         // Distance field: 0.5 is the outline, antialiased over one screen pixel.
+    \\         let coverage = clamp((gray - 0.5) / width + 0.5, 0.0, 1.0);
+    \\         return vec4f(in.color.rgb, in.color.a * coverage);
+    \\     }
+    \\     return vec4f(in.color.rgb, in.color.a * gray);
     \\ }
 ;
 
+const Uniforms = extern struct {
+    screen_size: [2]f32,
+    atlas_size: [2]f32,
+};
+
 const Command = struct {
     position: [2]f32,
     text: []const u8,
+    size: u16,
+    color: [4]f32,
+    layout: ?*Layout, // Drawn instead of `text` if set.
+    visible: [2]i32, // Vertical range of the layout on the screen, relative to its top (in px).
+};
+
+/// Instances uploaded for a command in the previous frame. They are reused as long as the command stays the same.
+const Run = struct {
+    text: std.ArrayList(u8), // Copy of the command text.
+    position: [2]f32,
+    size: u16,
+    color: [4]f32,
+    start: u32, // First instance in the instance buffer.
+    count: u32,
+    pages: [2]u64, // Bit set of atlas pages used by the glyphs, per `font.Format`.
+    valid: bool,
+    complete: bool, // False if glyphs were left out because the atlas was full, the run is built again next frame.
+    layout: ?*const Layout,
+    version: u64, // `Layout.version` the instances were built from.
+    visible: [2]i32,
+
+    fn matches(self: Run, command: Command) bool {
+        if (command.layout) |text_layout| {
+            if (self.layout == null or self.layout.? != text_layout) return false;
+            if (self.version != text_layout.version) return false;
+            if (!std.mem.eql(i32, &self.visible, &command.visible)) return false;
+        } else if (self.layout != null) {
+            return false;
+        }
+        return self.valid and self.complete and
+            std.mem.eql(f32, &self.position, &command.position) and
+            self.size == command.size and
+            std.mem.eql(f32, &self.color, &command.color) and
+            std.mem.eql(u8, self.text.items, command.text);
+    }
+};
+
+/// Range of the instance buffer.
+const Span = struct {
+    start: u32,
+    count: u32,
+
+    fn lessThan(_: void, a: Span, b: Span) bool {
+        return a.start < b.start;
+    }
 };
 
+const initial_capacity = 1024;
+
 /// Printer prints text on the screen.
+///
+/// Glyphs are uploaded as instances into a persistent buffer. Each command keeps its range of the buffer between
+/// frames, so text that didn't change is neither shaped nor uploaded again. Changed commands take the first free range
+/// that fits. When there is none, live ranges are compacted to the start of the buffer, which only grows if they don't
+/// fit.
 pub const Printer = struct {
     allocator: Allocator,
 
     font_library: *FontLibrary,
+    atlas: *GpuAtlas,
 
     gctx: *zgpu.GraphicsContext,
     pipeline: zgpu.RenderPipelineHandle,
@@ -57,15 +156,30 @@ pub const Printer = struct {
     depth_texture: zgpu.TextureHandle,
     depth_texture_view: zgpu.TextureViewHandle,
 
-    command_count: u32,
-    commands: []Command,
+    instance_buffer: zgpu.BufferHandle,
+    capacity: u32, // Size of `instance_buffer` in instances.
+    generation: u32, // `glyph_cache.generation` the runs were written with.
+
+    commands: std.ArrayList(Command),
+    runs: std.ArrayList(Run), // Indexed like `commands`.
+    instances: std.ArrayList(Instance), // Scratch space for the command being written.
+    spans: std.ArrayList(Span), // Scratch space for finding free ranges.
+    glyphs: std.ArrayList(font.GlyphShape), // Scratch space for glyphs of a command.
 
     dpr: u32,
 
-    pub fn init(allocator: Allocator, gctx: *zgpu.GraphicsContext, font_library: *FontLibrary, dpr: u32) !Printer {
+    pub fn init(
+        allocator: Allocator,
+        gctx: *zgpu.GraphicsContext,
+        font_library: *FontLibrary,
+        atlas: *GpuAtlas,
+        dpr: u32,
+    ) !Printer {
         const bind_group_layout = gctx.createBindGroupLayout(&.{
-            zgpu.textureEntry(0, .{ .fragment = true }, .float, .tvdim_2d, false),
+            zgpu.textureEntry(0, .{ .fragment = true }, .float, .tvdim_2d_array, false),
             zgpu.samplerEntry(1, .{ .fragment = true }, .filtering),
+            zgpu.textureEntry(2, .{ .fragment = true }, .float, .tvdim_2d_array, false),
+            zgpu.bufferEntry(3, .{ .vertex = true }, .uniform, true, 0),
         });
         defer gctx.releaseResource(bind_group_layout);
 
@@ -94,14 +208,18 @@ pub const Printer = struct {
             },
         }};
 
-        const vertex_attributes = [_]wgpu.VertexAttribute{
-            .{ .format = .float32x2, .offset = 0, .shader_location = 0 },
-            .{ .format = .float32x2, .offset = 2 * @sizeOf(f32), .shader_location = 1 },
+        const instance_attributes = [_]wgpu.VertexAttribute{
+            .{ .format = .float32x2, .offset = @offsetOf(Instance, "position"), .shader_location = 0 },
+            .{ .format = .uint16x4, .offset = @offsetOf(Instance, "rect"), .shader_location = 1 },
+            .{ .format = .uint16x2, .offset = @offsetOf(Instance, "page"), .shader_location = 2 },
+            .{ .format = .unorm8x4, .offset = @offsetOf(Instance, "color"), .shader_location = 3 },
+            .{ .format = .float32, .offset = @offsetOf(Instance, "scale"), .shader_location = 4 },
         };
         const vertex_buffers = [_]wgpu.VertexBufferLayout{.{
-            .array_stride = 4 * @sizeOf(f32),
-            .attribute_count = vertex_attributes.len,
-            .attributes = &vertex_attributes,
+            .array_stride = @sizeOf(Instance),
+            .step_mode = .instance,
+            .attribute_count = instance_attributes.len,
+            .attributes = &instance_attributes,
         }};
 
         const pipeline_descriptor = wgpu.RenderPipelineDescriptor{
@@ -137,38 +255,73 @@ pub const Printer = struct {
             .address_mode_w = .clamp_to_edge,
             .max_anisotropy = 1,
         });
-        const atlas_texture_view = gctx.createTextureView(font_library.atlas_texture, .{});
+        const gray_atlas_view = gctx.createTextureView(atlas.texture(.gray), .{
+            .dimension = .tvdim_2d_array,
+        });
+        const color_atlas_view = gctx.createTextureView(atlas.texture(.color), .{
+            .dimension = .tvdim_2d_array,
+        });
 
         const bind_group = gctx.createBindGroup(bind_group_layout, &.{
-            .{ .binding = 0, .texture_view_handle = atlas_texture_view },
+            .{ .binding = 0, .texture_view_handle = gray_atlas_view },
             .{ .binding = 1, .sampler_handle = sampler },
+            .{ .binding = 2, .texture_view_handle = color_atlas_view },
+            .{ .binding = 3, .buffer_handle = gctx.uniforms.buffer, .offset = 0, .size = @sizeOf(Uniforms) },
         });
 
         const depth = utils.createDepthTexture(gctx);
 
-        const commands = try allocator.alloc(Command, 1024);
-        @memset(commands, .{ .position = .{ 0, 0 }, .text = "" });
-
         return Printer{
             .gctx = gctx,
             .allocator = allocator,
             .font_library = font_library,
+            .atlas = atlas,
 
             .pipeline = pipeline,
             .bind_group = bind_group,
             .depth_texture = depth.texture,
             .depth_texture_view = depth.view,
 
-            .command_count = 0,
-            .commands = commands,
+            .instance_buffer = createInstanceBuffer(gctx, initial_capacity),
+            .capacity = initial_capacity,
+            .generation = font_library.glyph_cache.generation,
+
+            .commands = std.ArrayList(Command).init(allocator),
+            .runs = std.ArrayList(Run).init(allocator),
+            .instances = std.ArrayList(Instance).init(allocator),
+            .spans = std.ArrayList(Span).init(allocator),
+            .glyphs = std.ArrayList(font.GlyphShape).init(allocator),
 
             .dpr = dpr,
         };
     }
 
-    pub fn text(self: *Printer, value: []const u8, x: f32, y: f32) !void {
-        self.commands[self.command_count] = .{ .position = .{ x, y }, .text = value };
-        self.command_count += 1;
+    /// Queue text to be drawn at (x, y), `size` logical px high, in the given RGBA color. Color glyphs (emoji) only
+    /// use the alpha.
+    pub fn text(self: *Printer, value: []const u8, x: f32, y: f32, size: u16, color: [4]f32) !void {
+        try self.commands.append(.{
+            .position = .{ x, y },
+            .text = value,
+            .size = size,
+            .color = color,
+            .layout = null,
+            .visible = .{ 0, 0 },
+        });
+    }
+
+    /// Queue lines of the layout that are on the screen, with the top left corner of the layout at (x, y). The layout
+    /// is updated before drawing, and its glyphs are only rebuilt when it changes or scrolls.
+    pub fn layout(self: *Printer, value: *Layout, x: f32, y: f32, color: [4]f32) !void {
+        const top: i32 = @intFromFloat(@floor(-y));
+        const screen_height: i32 = @intCast(self.gctx.swapchain_descriptor.height);
+        try self.commands.append(.{
+            .position = .{ x, y },
+            .text = "",
+            .size = value.size,
+            .color = color,
+            .layout = value,
+            .visible = .{ top, top + screen_height },
+        });
     }
 
     pub fn draw(
@@ -176,90 +329,74 @@ pub const Printer = struct {
         back_buffer_view: zgpu.wgpu.TextureView,
         encoder: zgpu.wgpu.CommandEncoder,
     ) !void {
-        const atlas_size: f32 = @floatFromInt(self.font_library.atlas_size);
-        const screen_width: f32 = @floatFromInt(self.gctx.swapchain_descriptor.width);
-        const screen_height: f32 = @floatFromInt(self.gctx.swapchain_descriptor.height);
+        defer self.commands.clearRetainingCapacity();
 
-        var glyph_count: u32 = 0;
-        for (0..self.command_count) |i| {
-            glyph_count += @intCast(self.commands[i].text.len);
+        const cache = &self.font_library.glyph_cache;
+        cache.nextFrame();
+
+        // Pages evicted since the last frame might have been reused for other glyphs.
+        if (self.generation != cache.generation) {
+            for (self.runs.items) |*run| run.valid = false;
         }
 
-        // TODO: store previous buffer and detect if it is still valid and only render if not.
-        const vertex_buffer = self.gctx.createBuffer(.{
-            .usage = .{ .copy_dst = true, .vertex = true },
-            .size = glyph_count * 2 * 12 * @sizeOf(f32),
-        });
-        defer self.gctx.releaseResource(vertex_buffer);
-
-        const vertex_data = try self.allocator.alloc(f32, glyph_count * 2 * 12);
-        defer self.allocator.free(vertex_data);
-
-        var i: u32 = 0;
-        for (0..self.command_count) |c| {
-            const value = self.commands[c];
-            const glyphs = try font.shape(
-                self.allocator,
-                self.font_library.fonts,
-                value.text,
-                300, //std.math.maxInt(i32),
-            );
-            defer self.allocator.free(glyphs);
-
-            for (glyphs) |info| {
-                const p_x: f32 = @floatFromInt(info.glyph.x);
-                const p_y: f32 = @floatFromInt(info.glyph.y);
-                const s_x: f32 = @floatFromInt(info.glyph.width);
-                const s_y: f32 = @floatFromInt(info.glyph.height);
-
-                const x = (value.position[0] + @as(f32, @floatFromInt(info.x))) / screen_width * 2 - 1;
-                const y = -((value.position[1] + @as(f32, @floatFromInt(info.y))) / screen_height * 2 - 1);
-                const w: f32 = s_x / screen_width * 2;
-                const h: f32 = s_y / screen_height * 2;
-
-                // 0
-                vertex_data[i + 0] = x;
-                vertex_data[i + 1] = y - h;
-                vertex_data[i + 2] = p_x / atlas_size;
-                vertex_data[i + 3] = (p_y + s_y) / atlas_size;
-
-                // 1
-                vertex_data[i + 4] = x + w;
-                vertex_data[i + 5] = y - h;
-                vertex_data[i + 6] = (p_x + s_x) / atlas_size;
-                vertex_data[i + 7] = (p_y + s_y) / atlas_size;
-
-                // 2
-                vertex_data[i + 8] = x;
-                vertex_data[i + 9] = y;
-                vertex_data[i + 10] = p_x / atlas_size;
-                vertex_data[i + 11] = p_y / atlas_size;
-
-                // 3
-                vertex_data[i + 12] = x + w;
-                vertex_data[i + 13] = y - h;
-                vertex_data[i + 14] = (p_x + s_x) / atlas_size;
-                vertex_data[i + 15] = (p_y + s_y) / atlas_size;
-
-                // 4
-                vertex_data[i + 16] = x + w;
-                vertex_data[i + 17] = y;
-                vertex_data[i + 18] = (p_x + s_x) / atlas_size;
-                vertex_data[i + 19] = p_y / atlas_size;
-
-                // 5
-                vertex_data[i + 20] = x;
-                vertex_data[i + 21] = y;
-                vertex_data[i + 22] = p_x / atlas_size;
-                vertex_data[i + 23] = p_y / atlas_size;
-
-                i += 24;
+        // Runs of commands that were not drawn again are dropped.
+        while (self.runs.items.len > self.commands.items.len) {
+            const run = self.runs.pop();
+            run.text.deinit();
+        }
+        while (self.runs.items.len < self.commands.items.len) {
+            try self.runs.append(.{
+                .text = std.ArrayList(u8).init(self.allocator),
+                .position = .{ 0, 0 },
+                .size = 0,
+                .color = .{ 0, 0, 0, 0 },
+                .start = 0,
+                .count = 0,
+                .pages = .{ 0, 0 },
+                .valid = false,
+                .complete = false,
+                .layout = null,
+                .version = 0,
+                .visible = .{ 0, 0 },
+            });
+        }
+
+        // Keep glyphs of unchanged commands in the atlas before anything new is rasterized.
+        for (self.commands.items, self.runs.items) |command, *run| {
+            if (!run.matches(command)) {
+                run.valid = false;
+                continue;
+            }
+            for (run.pages, 0..) |pages, format| {
+                var bits = pages;
+                while (bits != 0) : (bits &= bits - 1) {
+                    cache.touchPage(@enumFromInt(format), @ctz(bits));
+                }
+            }
+        }
+
+        for (self.commands.items, self.runs.items) |command, *run| {
+            if (run.valid) continue;
+            run.complete = try self.build(command, run);
+
+            const count: u32 = @intCast(self.instances.items.len);
+            const start = try self.allocate(count) orelse try self.compact(encoder, count);
+
+            run.start = start;
+            run.count = count;
+            run.valid = true;
+            if (count != 0) {
+                const buffer = self.gctx.lookupResource(self.instance_buffer).?;
+                self.gctx.queue.writeBuffer(buffer, start * @sizeOf(Instance), Instance, self.instances.items);
             }
         }
+        // Evictions while building can't affect any run of this frame, as all their pages are in use.
+        self.generation = cache.generation;
 
-        self.gctx.queue.writeBuffer(self.gctx.lookupResource(vertex_buffer).?, 0, f32, vertex_data[0..]);
+        // Upload glyphs rasterized while shaping.
+        self.atlas.flush(cache);
 
-        const vb_info = self.gctx.lookupResourceInfo(vertex_buffer) orelse return;
+        const buffer_info = self.gctx.lookupResourceInfo(self.instance_buffer) orelse return;
         const pipeline = self.gctx.lookupResource(self.pipeline) orelse return;
         const bind_group = self.gctx.lookupResource(self.bind_group) orelse return;
         const depth_view = self.gctx.lookupResource(self.depth_texture_view) orelse return;
@@ -286,20 +423,137 @@ pub const Printer = struct {
             pass.release();
         }
 
-        pass.setVertexBuffer(0, vb_info.gpuobj.?, 0, vb_info.size);
+        const mem = self.gctx.uniformsAllocate(Uniforms, 1);
+        mem.slice[0] = .{
+            .screen_size = .{
+                @floatFromInt(self.gctx.swapchain_descriptor.width),
+                @floatFromInt(self.gctx.swapchain_descriptor.height),
+            },
+            .atlas_size = .{ @floatFromInt(self.atlas.size), @floatFromInt(self.atlas.size) },
+        };
+
+        pass.setVertexBuffer(0, buffer_info.gpuobj.?, 0, buffer_info.size);
         pass.setPipeline(pipeline);
-        pass.setBindGroup(0, bind_group, &.{});
-        pass.draw(glyph_count * 6, 1, 0, 0);
+        pass.setBindGroup(0, bind_group, &.{mem.offset});
+
+        // Draw in command order, merging runs that ended up next to each other in the buffer.
+        var first: u32 = 0;
+        var count: u32 = 0;
+        for (self.runs.items) |run| {
+            if (run.count == 0) continue;
+            if (count != 0 and run.start == first + count) {
+                count += run.count;
+                continue;
+            }
+            if (count != 0) pass.draw(6, count, 0, first);
+            first = run.start;
+            count = run.count;
+        }
+        if (count != 0) pass.draw(6, count, 0, first);
+    }
 
-        @memset(self.commands, .{ .position = .{ 0, 0 }, .text = "" });
-        self.command_count = 0;
+    /// Shape the command into `instances` and remember what it was built from. Returns false if glyphs were left out
+    /// because the atlas is full.
+    fn build(self: *Printer, command: Command, run: *Run) !bool {
+        self.instances.clearRetainingCapacity();
+        self.glyphs.clearRetainingCapacity();
+        const complete = if (command.layout) |text_layout| blk: {
+            try text_layout.update();
+            run.version = text_layout.version;
+            break :blk try text_layout.appendGlyphs(&self.glyphs, command.visible[0], command.visible[1]);
+        } else try font.appendShapes(&self.glyphs, self.font_library, command.text, command.size, false);
+        run.pages = try quads.appendQuads(&self.instances, self.glyphs.items, command.position, command.color);
+
+        run.text.clearRetainingCapacity();
+        try run.text.appendSlice(command.text);
+        run.position = command.position;
+        run.size = command.size;
+        run.color = command.color;
+        run.layout = command.layout;
+        run.visible = command.visible;
+        return complete;
+    }
+
+    /// Find the first gap of at least `count` instances between ranges of valid runs. Returns null if there is none.
+    fn allocate(self: *Printer, count: u32) !?u32 {
+        self.spans.clearRetainingCapacity();
+        for (self.runs.items) |run| {
+            if (run.valid and run.count != 0) try self.spans.append(.{ .start = run.start, .count = run.count });
+        }
+        std.mem.sort(Span, self.spans.items, {}, Span.lessThan);
+
+        var start: u32 = 0;
+        for (self.spans.items) |span| {
+            if (start + count <= span.start) return start;
+            start = span.start + span.count;
+        }
+        return if (start + count <= self.capacity) start else null;
+    }
+
+    /// Move valid runs next to each other, in command order, to the start of a new instance buffer. The buffer keeps
+    /// its capacity unless the runs and `count` more instances don't fit, then it grows. Instances are copied by the
+    /// GPU. Returns the start of the free space after the runs.
+    ///
+    /// Only ranges of valid runs are copied, so free space can be written with `writeBuffer()` in the same frame
+    /// (writes execute before the copies).
+    fn compact(self: *Printer, encoder: zgpu.wgpu.CommandEncoder, count: u32) !u32 {
+        var live: u32 = 0;
+        for (self.runs.items) |run| {
+            if (run.valid) live += run.count;
+        }
+        const capacity = if (live + count <= self.capacity) self.capacity else @max(self.capacity * 2, live + count);
+        const buffer = createInstanceBuffer(self.gctx, capacity);
+
+        const old = self.gctx.lookupResource(self.instance_buffer) orelse return error.InvalidBuffer;
+        const new = self.gctx.lookupResource(buffer) orelse return error.InvalidBuffer;
+
+        // Runs that are already next to each other are copied together.
+        var copy = Span{ .start = 0, .count = 0 };
+        var offset: u32 = 0;
+        for (self.runs.items) |*run| {
+            if (!run.valid or run.count == 0) continue;
+            if (copy.count != 0 and run.start != copy.start + copy.count) {
+                copyInstances(encoder, old, new, copy, offset - copy.count);
+                copy.count = 0;
+            }
+            if (copy.count == 0) copy.start = run.start;
+            copy.count += run.count;
+            run.start = offset;
+            offset += run.count;
+        }
+        if (copy.count != 0) copyInstances(encoder, old, new, copy, offset - copy.count);
+
+        self.gctx.releaseResource(self.instance_buffer);
+        self.instance_buffer = buffer;
+        self.capacity = capacity;
+        return offset;
     }
 
     pub fn deinit(self: *Printer) void {
-        self.allocator.free(self.commands);
+        for (self.runs.items) |*run| {
+            run.text.deinit();
+        }
+        self.runs.deinit();
+        self.commands.deinit();
+        self.instances.deinit();
+        self.spans.deinit();
+        self.glyphs.deinit();
+        self.gctx.releaseResource(self.instance_buffer);
         self.gctx.releaseResource(self.bind_group);
         self.gctx.releaseResource(self.pipeline);
         self.gctx.releaseResource(self.depth_texture);
         self.gctx.releaseResource(self.depth_texture_view);
     }
 };
+
+fn copyInstances(encoder: zgpu.wgpu.CommandEncoder, from: wgpu.Buffer, to: wgpu.Buffer, span: Span, start: u32) void {
+    const size: usize = @sizeOf(Instance);
+    encoder.copyBufferToBuffer(from, span.start * size, to, start * size, span.count * size);
+}
+
+fn createInstanceBuffer(gctx: *zgpu.GraphicsContext, capacity: u32) zgpu.BufferHandle {
+    return gctx.createBuffer(.{
+        .usage = .{ .copy_dst = true, .copy_src = true, .vertex = true },
+        .size = capacity * @sizeOf(Instance),
+    });
+}
@@ -0,0 +1,70 @@
+const std = @import("std");
+const font = @import("font.zig");
+const GlyphShape = font.GlyphShape;
+
+/// How the fragment shader turns atlas pixels into color.
+pub const Mode = enum(u16) {
+    coverage = 0, // Gray atlas, tinted with the instance color.
+    color = 1, // Color atlas, used as is.
+    sdf = 2, // Gray atlas holding a signed distance field, tinted with the instance color.
+
+    pub fn format(self: Mode) font.Format {
+        return if (self == .color) .color else .gray;
+    }
+};
+
+/// One glyph quad, in the layout used by the instance buffer of `Printer`.
+pub const Instance = extern struct {
+    position: [2]f32, // Top left corner on the screen (in px).
+    scale: f32, // Size of the quad relative to `rect`.
+    rect: [4]u16, // x, y, width and height in the atlas page (in px).
+    page: u16,
+    mode: Mode,
+    color: [4]u8,
+};
+
+/// Convert color from floats in 0..1 range to 8 bits per channel.
+pub fn packColor(color: [4]f32) [4]u8 {
+    var result: [4]u8 = undefined;
+    for (&result, color) |*channel, value| {
+        channel.* = @intFromFloat(@round(std.math.clamp(value, 0, 1) * 255));
+    }
+    return result;
+}
+
+/// Append a quad for every visible glyph of shaped text placed at `position`. Returns bit sets of atlas pages used by
+/// the quads, per `font.Format`.
+pub fn appendQuads(
+    list: *std.ArrayList(Instance),
+    glyphs: []const GlyphShape,
+    position: [2]f32,
+    color: [4]f32,
+) ![2]u64 {
+    const packed_color = packColor(color);
+    var pages = [2]u64{ 0, 0 };
+
+    try list.ensureUnusedCapacity(glyphs.len);
+    for (glyphs) |info| {
+        // Whitespace has nothing to draw.
+        if (info.glyph.width == 0) continue;
+
+        list.appendAssumeCapacity(.{
+            .position = .{
+                position[0] + @as(f32, @floatFromInt(info.x)),
+                position[1] + @as(f32, @floatFromInt(info.y)),
+            },
+            .rect = .{
+                @intCast(info.glyph.x),
+                @intCast(info.glyph.y),
+                @intCast(info.glyph.width),
+                @intCast(info.glyph.height),
+            },
+            .scale = info.scale,
+            .page = @intCast(info.glyph.page),
+            .mode = if (info.glyph.format == .color) .color else if (info.glyph.sdf) .sdf else .coverage,
+            .color = packed_color,
+        });
+        pages[@intFromEnum(info.glyph.format)] |= @as(u64, 1) << @intCast(info.glyph.page);
+    }
+    return pages;
+}
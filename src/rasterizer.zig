@@ -0,0 +1,287 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const ft = @import("mach-freetype");
+const font = @import("font.zig");
+const Font = font.Font;
+const glyph_cache = @import("glyph_cache.zig");
+const GlyphCache = glyph_cache.GlyphCache;
+const GlyphKey = glyph_cache.GlyphKey;
+const GlyphInfo = glyph_cache.GlyphInfo;
+const Bitmap = glyph_cache.Bitmap;
+
+/// Batches smaller than this are rendered on the calling thread, where spinning up the workers would cost more than it
+/// saves.
+const PARALLEL_THRESHOLD = 32;
+
+/// FreeType objects are not thread safe, so every worker has its own library and faces. Rendered bitmaps are copied to
+/// `arena` and live until the end of the batch.
+const Worker = struct {
+    ft_lib: ft.Library,
+    fonts: []Font,
+    arena: std.heap.ArenaAllocator,
+
+    fn init(allocator: Allocator, fonts: []const Font) !Worker {
+        var ft_lib = try ft.Library.init();
+        errdefer ft_lib.deinit();
+        try font.configureLibrary(&ft_lib);
+
+        const copies = try allocator.alloc(Font, fonts.len);
+        errdefer allocator.free(copies);
+
+        var initialized: usize = 0;
+        errdefer {
+            for (copies[0..initialized]) |*copy| copy.deinit();
+        }
+        for (copies, fonts) |*copy, original| {
+            copy.* = try Font.init(&ft_lib, original.data);
+            copy.sdf = original.sdf;
+            initialized += 1;
+        }
+
+        return .{ .ft_lib = ft_lib, .fonts = copies, .arena = std.heap.ArenaAllocator.init(allocator) };
+    }
+
+    fn deinit(self: *Worker, allocator: Allocator) void {
+        for (self.fonts) |*f| {
+            f.deinit();
+        }
+        allocator.free(self.fonts);
+        self.ft_lib.deinit();
+        self.arena.deinit();
+    }
+};
+
+/// Renders batches of glyphs into the glyph cache using a pool of threads.
+///
+/// Each glyph is rendered exactly once. Bitmaps are rendered in parallel, packed on the calling thread in the order in
+/// which they were requested and then copied into the atlas in parallel. The resulting atlas is byte-identical to the
+/// one produced with a single thread.
+pub const Rasterizer = struct {
+    allocator: Allocator,
+    pool: ?*std.Thread.Pool, // Null when running single-threaded.
+    workers: []Worker,
+
+    pub fn init(allocator: Allocator, fonts: []const Font, thread_count: u32) !Rasterizer {
+        if (thread_count <= 1) {
+            return Rasterizer{ .allocator = allocator, .pool = null, .workers = &.{} };
+        }
+
+        const workers = try allocator.alloc(Worker, thread_count);
+        errdefer allocator.free(workers);
+
+        var initialized: usize = 0;
+        errdefer {
+            for (workers[0..initialized]) |*worker| worker.deinit(allocator);
+        }
+        for (workers) |*worker| {
+            worker.* = try Worker.init(allocator, fonts);
+            initialized += 1;
+        }
+
+        const pool = try allocator.create(std.Thread.Pool);
+        errdefer allocator.destroy(pool);
+        try pool.init(.{ .allocator = allocator, .n_jobs = thread_count });
+
+        return Rasterizer{ .allocator = allocator, .pool = pool, .workers = workers };
+    }
+
+    pub fn deinit(self: *Rasterizer) void {
+        if (self.pool) |pool| {
+            pool.deinit();
+            self.allocator.destroy(pool);
+        }
+        for (self.workers) |*worker| {
+            worker.deinit(self.allocator);
+        }
+        self.allocator.free(self.workers);
+    }
+
+    /// Make sure all glyphs from `keys` are present in the cache. `fonts` are used for batches rendered on the calling
+    /// thread.
+    pub fn rasterize(self: *Rasterizer, fonts: []Font, cache: *GlyphCache, keys: []const GlyphKey) !void {
+        var missing = std.ArrayList(GlyphKey).init(self.allocator);
+        defer missing.deinit();
+
+        var seen = std.AutoHashMap(GlyphKey, void).init(self.allocator);
+        defer seen.deinit();
+
+        for (keys) |key| {
+            if (cache.get(key) != null) continue;
+            if ((try seen.getOrPut(key)).found_existing) continue;
+            try missing.append(key);
+        }
+
+        const pool = self.pool orelse return rasterizeSerial(fonts, cache, missing.items);
+        if (missing.items.len < PARALLEL_THRESHOLD) {
+            return rasterizeSerial(fonts, cache, missing.items);
+        }
+
+        const bitmaps = try self.allocator.alloc(?Bitmap, missing.items.len);
+        defer self.allocator.free(bitmaps);
+
+        const infos = try self.allocator.alloc(?GlyphInfo, missing.items.len);
+        defer self.allocator.free(infos);
+
+        defer {
+            for (self.workers) |*worker| {
+                _ = worker.arena.reset(.retain_capacity);
+            }
+        }
+
+        // Render.
+        {
+            var wait_group = std.Thread.WaitGroup{};
+            for (self.workers, 0..) |*worker, i| {
+                const range = chunk(missing.items.len, self.workers.len, i);
+                const args = .{ worker, missing.items[range.start..range.end], bitmaps[range.start..range.end], &wait_group };
+                wait_group.start();
+                pool.spawn(renderWorker, args) catch @call(.auto, renderWorker, args);
+            }
+            pool.waitAndWork(&wait_group);
+        }
+
+        // Pack in the original order so that positions don't depend on the thread count. If the atlas fills up, glyphs
+        // packed before that are registered in the cache already, so their pixels are copied before the error returns.
+        var reserved: usize = 0;
+        defer self.blit(pool, cache, infos[0..reserved], bitmaps[0..reserved]);
+        for (missing.items, bitmaps, infos) |key, bitmap, *info| {
+            info.* = if (bitmap) |b| try cache.reserve(key, b) else null;
+            reserved += 1;
+        }
+    }
+
+    /// Copy bitmaps into the atlas.
+    fn blit(
+        self: *Rasterizer,
+        pool: *std.Thread.Pool,
+        cache: *const GlyphCache,
+        infos: []const ?GlyphInfo,
+        bitmaps: []const ?Bitmap,
+    ) void {
+        var wait_group = std.Thread.WaitGroup{};
+        for (0..self.workers.len) |i| {
+            const range = chunk(infos.len, self.workers.len, i);
+            const args = .{ cache, infos[range.start..range.end], bitmaps[range.start..range.end], &wait_group };
+            wait_group.start();
+            pool.spawn(blitWorker, args) catch @call(.auto, blitWorker, args);
+        }
+        pool.waitAndWork(&wait_group);
+    }
+};
+
+fn rasterizeSerial(fonts: []Font, cache: *GlyphCache, keys: []const GlyphKey) !void {
+    for (keys) |key| {
+        const bitmap = fonts[key.font].renderGlyph(key.glyph_id, key.size) catch |err| {
+            std.debug.print("Failed to render glyph {d} ({s})\n", .{ key.glyph_id, @errorName(err) });
+            continue;
+        };
+        _ = try cache.insert(key, bitmap);
+    }
+}
+
+fn renderWorker(worker: *Worker, keys: []const GlyphKey, bitmaps: []?Bitmap, wait_group: *std.Thread.WaitGroup) void {
+    defer wait_group.finish();
+    for (keys, bitmaps) |key, *bitmap| {
+        bitmap.* = renderCopy(worker, key) catch |err| blk: {
+            std.debug.print("Failed to render glyph {d} ({s})\n", .{ key.glyph_id, @errorName(err) });
+            break :blk null;
+        };
+    }
+}
+
+fn renderCopy(worker: *Worker, key: GlyphKey) !Bitmap {
+    var bitmap = try worker.fonts[key.font].renderGlyph(key.glyph_id, key.size);
+    // The bitmap belongs to the face and is overwritten by the next glyph.
+    bitmap.buffer = try worker.arena.allocator().dupe(u8, bitmap.buffer);
+    return bitmap;
+}
+
+fn blitWorker(cache: *const GlyphCache, infos: []const ?GlyphInfo, bitmaps: []const ?Bitmap, wait_group: *std.Thread.WaitGroup) void {
+    defer wait_group.finish();
+    for (infos, bitmaps) |info, bitmap| {
+        cache.write(info orelse continue, bitmap orelse continue);
+    }
+}
+
+/// Split `len` items into `count` contiguous chunks and return the `index`-th one.
+fn chunk(len: usize, count: usize, index: usize) struct { start: usize, end: usize } {
+    const size = (len + count - 1) / count;
+    const start = @min(len, index * size);
+    return .{ .start = start, .end = @min(len, start + size) };
+}
+
+test "parallel rasterization produces the same atlas as serial" {
+    const allocator = std.testing.allocator;
+    var serial = try font.FontLibrary.init(allocator, 1, .{ .thread_count = 1, .cache_path = null });
+    defer serial.deinit();
+    var parallel = try font.FontLibrary.init(allocator, 1, .{ .thread_count = 4, .cache_path = null });
+    defer parallel.deinit();
+
+    // Enough outline glyphs to use the thread pool, followed by color emoji.
+    var keys = std.ArrayList(GlyphKey).init(allocator);
+    defer keys.deinit();
+    const latin: u16 = @intFromEnum(font.FontMapping.Latin);
+    for (1..PARALLEL_THRESHOLD * 3) |glyph_id| {
+        try keys.append(.{ .font = latin, .glyph_id = @intCast(glyph_id), .size = font.font_size });
+    }
+    const emoji: u16 = @intFromEnum(font.FontMapping.Emoji);
+    var codepoints = (try std.unicode.Utf8View.init("😀😂🥲😍🤔😴🤯🥳😎🤖👻💩🙈🙉🙊")).iterator();
+    while (codepoints.nextCodepoint()) |codepoint| {
+        const glyph_id = serial.fonts[emoji].ft_face.getCharIndex(codepoint) orelse return error.MissingGlyph;
+        try keys.append(.{ .font = emoji, .glyph_id = glyph_id, .size = font.font_size });
+    }
+    try std.testing.expect(keys.items.len > PARALLEL_THRESHOLD);
+
+    try serial.rasterize(keys.items);
+    try parallel.rasterize(keys.items);
+
+    var color_glyphs: usize = 0;
+    for (keys.items) |key| {
+        const expected = serial.glyph_cache.get(key) orelse return error.MissingGlyph;
+        try std.testing.expectEqual(expected, parallel.glyph_cache.get(key) orelse return error.MissingGlyph);
+        if (expected.format == .color) color_glyphs += 1;
+    }
+    try std.testing.expect(color_glyphs > 0);
+
+    for ([_]glyph_cache.Format{ .gray, .color }) |format| {
+        const page_count = serial.glyph_cache.atlas(format).pages.items.len;
+        try std.testing.expectEqual(page_count, parallel.glyph_cache.atlas(format).pages.items.len);
+        for (0..page_count) |i| {
+            try std.testing.expectEqualSlices(
+                u8,
+                serial.glyph_cache.pagePixels(format, @intCast(i)),
+                parallel.glyph_cache.pagePixels(format, @intCast(i)),
+            );
+        }
+    }
+}
+
+test "glyphs packed before the atlas fills up get their pixels" {
+    const allocator = std.testing.allocator;
+    var library = try font.FontLibrary.init(allocator, 1, .{ .thread_count = 4, .cache_path = null });
+    defer library.deinit();
+
+    var keys = std.ArrayList(GlyphKey).init(allocator);
+    defer keys.deinit();
+    const latin: u16 = @intFromEnum(font.FontMapping.Latin);
+    for (1..PARALLEL_THRESHOLD * 3) |glyph_id| {
+        try keys.append(.{ .font = latin, .glyph_id = @intCast(glyph_id), .size = font.font_size });
+    }
+
+    // A single small page, which all pages of the current frame can't make room in.
+    const options = GlyphCache.Options{ .page_size = 64, .max_gray_pages = 1, .max_color_pages = 1 };
+    var parallel = GlyphCache.init(allocator, options);
+    defer parallel.deinit();
+    try std.testing.expectError(
+        error.AtlasFull,
+        library.rasterizer.rasterize(library.fonts, &parallel, keys.items),
+    );
+
+    var serial = GlyphCache.init(allocator, options);
+    defer serial.deinit();
+    try std.testing.expectError(error.AtlasFull, rasterizeSerial(library.fonts, &serial, keys.items));
+
+    try std.testing.expect(parallel.glyphs.count() > 0);
+    try std.testing.expectEqual(serial.glyphs.count(), parallel.glyphs.count());
+    try std.testing.expectEqualSlices(u8, serial.pagePixels(.gray, 0), parallel.pagePixels(.gray, 0));
+}
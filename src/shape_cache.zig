@@ -0,0 +1,331 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const hb = @import("mach-harfbuzz");
+
+/// Glyph of a shaped run, before it is placed in the atlas. Positions are in 26.6 fixed point as returned by HarfBuzz.
+pub const ShapedGlyph = struct {
+    glyph_id: u32,
+    x_offset: i32,
+    y_offset: i32,
+    x_advance: i32,
+    y_advance: i32,
+};
+
+/// Everything that affects result of shaping a run of text.
+pub const RunKey = struct {
+    text: []const u8,
+    font: u16,
+    script: hb.Script,
+    direction: hb.Direction,
+    size: u16,
+};
+
+const RunContext = struct {
+    pub fn hash(_: RunContext, key: RunKey) u64 {
+        var hasher = std.hash.Wyhash.init(0);
+        hasher.update(key.text);
+        const props = [_]u32{ key.font, @intFromEnum(key.script), @intFromEnum(key.direction), key.size };
+        hasher.update(std.mem.sliceAsBytes(&props));
+        return hasher.final();
+    }
+
+    pub fn eql(_: RunContext, a: RunKey, b: RunKey) bool {
+        return a.font == b.font and a.script == b.script and a.direction == b.direction and a.size == b.size and
+            std.mem.eql(u8, a.text, b.text);
+    }
+};
+
+const Entry = struct {
+    key: RunKey, // `text` is owned by the cache.
+    glyphs: []ShapedGlyph,
+
+    fn bytes(self: Entry) usize {
+        return entryBytes(self.key.text.len, self.glyphs.len);
+    }
+};
+
+fn entryBytes(text_len: usize, glyph_count: usize) usize {
+    return @sizeOf(List.Node) + text_len + glyph_count * @sizeOf(ShapedGlyph);
+}
+
+const List = std.DoublyLinkedList(Entry);
+const RunMap = std.HashMap(RunKey, *List.Node, RunContext, std.hash_map.default_max_load_percentage);
+
+/// LRU cache of shaped runs. Most UI text doesn't change between frames, so shaping it once and reusing the result
+/// saves almost all of the per-frame shaping cost.
+///
+/// Memory used by the entries (text, glyphs and bookkeeping) is kept under `max_bytes` by evicting the least recently
+/// used runs.
+pub const ShapeCache = struct {
+    allocator: Allocator,
+    max_bytes: usize,
+    bytes: usize,
+    runs: RunMap,
+    lru: List, // Least recently used first.
+
+    hits: u64,
+    misses: u64,
+    evictions: u64,
+
+    pub const Options = struct {
+        max_bytes: usize = 1024 * 1024,
+    };
+
+    pub const Stats = struct {
+        hits: u64,
+        misses: u64,
+        evictions: u64,
+        bytes: usize, // Memory currently used by the entries.
+        runs: usize, // Number of cached runs.
+    };
+
+    pub fn init(allocator: Allocator, options: Options) ShapeCache {
+        return .{
+            .allocator = allocator,
+            .max_bytes = options.max_bytes,
+            .bytes = 0,
+            .runs = RunMap.init(allocator),
+            .lru = .{},
+            .hits = 0,
+            .misses = 0,
+            .evictions = 0,
+        };
+    }
+
+    pub fn deinit(self: *ShapeCache) void {
+        while (self.lru.popFirst()) |node| {
+            self.destroy(node);
+        }
+        self.runs.deinit();
+    }
+
+    /// Return glyphs of a previously shaped run and mark it as recently used. Returned slice is valid until the next
+    /// `put()`. Counts a hit or a miss.
+    pub fn get(self: *ShapeCache, key: RunKey) ?[]const ShapedGlyph {
+        const node = self.runs.get(key) orelse {
+            self.misses += 1;
+            return null;
+        };
+        self.hits += 1;
+        self.lru.remove(node);
+        self.lru.append(node);
+        return node.data.glyphs;
+    }
+
+    /// Store a copy of the shaped run. Returned slice is owned by the cache and valid until the next `put()`. Runs that
+    /// don't fit in the budget on their own are not stored and `glyphs` is returned as is.
+    pub fn put(self: *ShapeCache, key: RunKey, glyphs: []const ShapedGlyph) ![]const ShapedGlyph {
+        const size = entryBytes(key.text.len, glyphs.len);
+        if (size > self.max_bytes) {
+            return glyphs;
+        }
+
+        if (self.runs.get(key)) |existing| {
+            self.remove(existing);
+        }
+        while (self.bytes + size > self.max_bytes) {
+            const oldest = self.lru.first orelse break;
+            self.remove(oldest);
+            self.evictions += 1;
+        }
+
+        const node = try self.allocator.create(List.Node);
+        errdefer self.allocator.destroy(node);
+
+        const text = try self.allocator.dupe(u8, key.text);
+        errdefer self.allocator.free(text);
+
+        const copy = try self.allocator.dupe(ShapedGlyph, glyphs);
+        errdefer self.allocator.free(copy);
+
+        var owned_key = key;
+        owned_key.text = text;
+        node.data = .{ .key = owned_key, .glyphs = copy };
+
+        try self.runs.putNoClobber(owned_key, node);
+        self.lru.append(node);
+        self.bytes += size;
+        return copy;
+    }
+
+    pub fn stats(self: *const ShapeCache) Stats {
+        return .{
+            .hits = self.hits,
+            .misses = self.misses,
+            .evictions = self.evictions,
+            .bytes = self.bytes,
+            .runs = self.runs.count(),
+        };
+    }
+
+    /// Drop all runs, for example after fonts or sizes change. Counters are kept.
+    pub fn clear(self: *ShapeCache) void {
+        while (self.lru.popFirst()) |node| {
+            self.destroy(node);
+        }
+        self.runs.clearRetainingCapacity();
+        self.bytes = 0;
+    }
+
+    fn remove(self: *ShapeCache, node: *List.Node) void {
+        _ = self.runs.remove(node.data.key);
+        self.lru.remove(node);
+        self.bytes -= node.data.bytes();
+        self.destroy(node);
+    }
+
+    fn destroy(self: *ShapeCache, node: *List.Node) void {
+        self.allocator.free(node.data.key.text);
+        self.allocator.free(node.data.glyphs);
+        self.allocator.destroy(node);
+    }
+};
+
+/// Reusable HarfBuzz buffers, so shaping doesn't allocate a new buffer (and its internal arrays) for every run.
+pub const BufferPool = struct {
+    free: std.ArrayList(hb.Buffer),
+
+    pub fn init(allocator: Allocator) BufferPool {
+        return .{ .free = std.ArrayList(hb.Buffer).init(allocator) };
+    }
+
+    pub fn deinit(self: *BufferPool) void {
+        for (self.free.items) |*buffer| {
+            buffer.deinit();
+        }
+        self.free.deinit();
+    }
+
+    /// Take an empty buffer from the pool, creating one if the pool is empty.
+    pub fn acquire(self: *BufferPool) !hb.Buffer {
+        if (self.free.popOrNull()) |buffer| {
+            return buffer;
+        }
+        return hb.Buffer.init() orelse error.OutOfMemory;
+    }
+
+    /// Return the buffer to the pool. Its contents and properties are reset but allocated memory is kept.
+    pub fn release(self: *BufferPool, buffer: *hb.Buffer) void {
+        buffer.reset();
+        self.free.append(buffer.*) catch buffer.deinit();
+    }
+};
+
+fn testKey(text: []const u8) RunKey {
+    return .{ .text = text, .font = 0, .script = .latin, .direction = .ltr, .size = 16 };
+}
+
+/// Glyphs with ids `first`, `first + 1`, … to tell runs apart.
+fn testGlyphs(buffer: []ShapedGlyph, first: u32) []const ShapedGlyph {
+    for (buffer, 0..) |*glyph, i| {
+        glyph.* = .{
+            .glyph_id = first + @as(u32, @intCast(i)),
+            .x_offset = 0,
+            .y_offset = 0,
+            .x_advance = 64,
+            .y_advance = 0,
+        };
+    }
+    return buffer;
+}
+
+fn expectRun(cache: *ShapeCache, text: []const u8, expected: []const ShapedGlyph) !void {
+    const glyphs = cache.get(testKey(text)) orelse return error.TestExpectedRun;
+    try std.testing.expectEqualSlices(ShapedGlyph, expected, glyphs);
+}
+
+test "least recently used run is evicted" {
+    var cache = ShapeCache.init(std.testing.allocator, .{ .max_bytes = 3 * entryBytes(1, 1) });
+    defer cache.deinit();
+
+    var buffers: [4][1]ShapedGlyph = undefined;
+    _ = try cache.put(testKey("a"), testGlyphs(&buffers[0], 1));
+    _ = try cache.put(testKey("b"), testGlyphs(&buffers[1], 2));
+    _ = try cache.put(testKey("c"), testGlyphs(&buffers[2], 3));
+    try expectRun(&cache, "a", &buffers[0]); // Now "b" is the oldest.
+
+    _ = try cache.put(testKey("d"), testGlyphs(&buffers[3], 4));
+    try std.testing.expect(cache.get(testKey("b")) == null);
+    try expectRun(&cache, "a", &buffers[0]);
+    try expectRun(&cache, "c", &buffers[2]);
+    try expectRun(&cache, "d", &buffers[3]);
+    try std.testing.expectEqual(@as(usize, 3 * entryBytes(1, 1)), cache.stats().bytes);
+
+    // A longer run makes room by evicting as many runs as needed, oldest first.
+    var long: [2]ShapedGlyph = undefined;
+    _ = try cache.put(testKey("ee"), testGlyphs(&long, 5));
+    try std.testing.expect(cache.get(testKey("a")) == null);
+    try std.testing.expect(cache.get(testKey("c")) == null);
+    try expectRun(&cache, "d", &buffers[3]);
+    try expectRun(&cache, "ee", &long);
+    try std.testing.expect(cache.stats().bytes <= cache.max_bytes);
+    try std.testing.expectEqual(@as(u64, 3), cache.stats().evictions);
+}
+
+test "run larger than the budget is returned but not stored" {
+    var cache = ShapeCache.init(std.testing.allocator, .{ .max_bytes = entryBytes(1, 2) });
+    defer cache.deinit();
+
+    var small: [1]ShapedGlyph = undefined;
+    _ = try cache.put(testKey("a"), testGlyphs(&small, 1));
+
+    var large: [3]ShapedGlyph = undefined;
+    const glyphs = try cache.put(testKey("b"), testGlyphs(&large, 2));
+    try std.testing.expectEqual(@as([*]const ShapedGlyph, &large), glyphs.ptr);
+    try std.testing.expect(cache.get(testKey("b")) == null);
+
+    // Nothing was evicted to make room for it.
+    try expectRun(&cache, "a", &small);
+    const stats = cache.stats();
+    try std.testing.expectEqual(@as(usize, 1), stats.runs);
+    try std.testing.expectEqual(entryBytes(1, 1), stats.bytes);
+    try std.testing.expectEqual(@as(u64, 0), stats.evictions);
+}
+
+test "putting a cached run again replaces it" {
+    var cache = ShapeCache.init(std.testing.allocator, .{});
+    defer cache.deinit();
+
+    // The cache keeps its own copy of the text.
+    var text = [_]u8{ 'a', 'b' };
+    var old: [1]ShapedGlyph = undefined;
+    var new: [3]ShapedGlyph = undefined;
+    _ = try cache.put(testKey(&text), testGlyphs(&old, 1));
+    const glyphs = try cache.put(testKey(&text), testGlyphs(&new, 2));
+    try std.testing.expectEqualSlices(ShapedGlyph, &new, glyphs);
+    text[0] = 'x';
+
+    try expectRun(&cache, "ab", &new);
+    try std.testing.expect(cache.get(testKey("xb")) == null);
+    const stats = cache.stats();
+    try std.testing.expectEqual(@as(usize, 1), stats.runs);
+    try std.testing.expectEqual(entryBytes(2, 3), stats.bytes);
+    try std.testing.expectEqual(@as(u64, 0), stats.evictions);
+}
+
+test "hits, misses and evictions are counted" {
+    var cache = ShapeCache.init(std.testing.allocator, .{ .max_bytes = entryBytes(1, 1) });
+    defer cache.deinit();
+
+    var buffers: [2][1]ShapedGlyph = undefined;
+    try std.testing.expect(cache.get(testKey("a")) == null);
+    _ = try cache.put(testKey("a"), testGlyphs(&buffers[0], 1));
+    try expectRun(&cache, "a", &buffers[0]);
+    try expectRun(&cache, "a", &buffers[0]);
+    _ = try cache.put(testKey("b"), testGlyphs(&buffers[1], 2));
+    try std.testing.expect(cache.get(testKey("a")) == null);
+
+    var stats = cache.stats();
+    try std.testing.expectEqual(@as(u64, 2), stats.hits);
+    try std.testing.expectEqual(@as(u64, 2), stats.misses);
+    try std.testing.expectEqual(@as(u64, 1), stats.evictions);
+    try std.testing.expectEqual(@as(usize, 1), stats.runs);
+
+    // Clearing drops the runs but keeps the counters.
+    cache.clear();
+    stats = cache.stats();
+    try std.testing.expectEqual(@as(usize, 0), stats.runs);
+    try std.testing.expectEqual(@as(usize, 0), stats.bytes);
+    try std.testing.expectEqual(@as(u64, 2), stats.hits);
+    try std.testing.expectEqual(@as(u64, 1), stats.evictions);
+}
@@ -0,0 +1,14 @@
+// Unit tests of the text pipeline. Like the benchmark they run without a window or GPU.
+//
+// zig build test
+
+test {
+    _ = @import("atlas_file.zig");
+    _ = @import("bidi.zig");
+    _ = @import("font.zig");
+    _ = @import("glyph_cache.zig");
+    _ = @import("layout.zig");
+    _ = @import("line_break.zig");
+    _ = @import("rasterizer.zig");
+    _ = @import("shape_cache.zig");
+}